@@ -0,0 +1,1809 @@
+/*
+ * alarm.c
+ *
+ * The alarm scheduler. Alarms are kept on a list sorted by
+ * expiration time. The alarm thread waits on a condition
+ * variable, with a timeout that corresponds to the earliest timer
+ * request. If the main thread enters an earlier timeout, it
+ * signals the condition variable so that the alarm thread will
+ * wake up and process the earlier timeout first.
+ *
+ * There is one such list, with its own mutex, condition variable
+ * and alarm thread, per shard (see alarm_shard_t in alarm.h); the
+ * alarms of a group all live in the same shard.
+ *
+ * The alarm threads wait on CLOCK_MONOTONIC. An alarm set for a time
+ * of day is on CLOCK_REALTIME instead, and its deadline is turned
+ * into a monotonic one with the difference between the two clocks,
+ * which only changes when someone sets the system clock; the
+ * thread alarm_clock_watch then wakes the alarm threads to do it
+ * again. Shards without such alarms never read CLOCK_REALTIME.
+ *
+ * Every reading of either clock goes through alarm_now_ns, so that
+ * the scheduler can also run on a virtual clock (see
+ * alarm_clock_virtual), which only moves when it is told to.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include "alarm.h"
+
+alarm_t *alarm_pool = NULL;
+alarm_cold_t *alarm_cold = NULL;
+alarm_shard_t *alarm_shards = NULL;
+int alarm_shard_count = 0;
+int alarm_readonly = 0;
+int64_t alarm_spin_ns = 0;              /* spin for deadlines this close */
+static sem_t sem_local[2];
+sem_t *sem_start_alarm = &sem_local[0];
+sem_t *sem_display_threads = &sem_local[1];
+
+/*
+ * Called by an alarm thread, with its shard's mutex locked, to
+ * deliver the expiry message of an alarm to the channel that
+ * created it. It must not block. With no hook installed (or for
+ * owner 0) the message goes to stdout.
+ */
+void (*alarm_notify) (uint32_t owner, const char *text, size_t len) = NULL;
+
+thread_place_t alarm_place;
+thread_place_t intake_place;
+
+/*
+ * The alarm pool is one reservation of address space holding
+ * ALARM_POOL_MAX alarms, so alarms are addressed by index and
+ * never move. Each shard owns an equal slice of it. Entries that
+ * have never been used are handed out from the shard's pool_top;
+ * freed entries are chained through their link field on its
+ * pool_free.
+ */
+
+/*
+ * Epoch-based reclamation.
+ *
+ * Readers (View_Alarms) walk the shard lists without any mutex,
+ * so an alarm that is unlinked from the list may still be in
+ * use by a reader and cannot be freed straight away. Instead it
+ * is "retired" together with the global epoch at the time it was
+ * unlinked. A reader announces the epoch it started in through an
+ * epoch_state slot; the global epoch only advances once every
+ * active reader has caught up with it, so two advances after an
+ * alarm was retired no reader can still hold a reference to it.
+ *
+ * Writers still serialize on their shard's mutex, which also
+ * protects the shard's retired list. The epoch is shared by all
+ * shards and advanced with a compare-and-swap. The list links are written
+ * with release stores and read by readers with acquire loads, so a
+ * reader always sees a fully initialized alarm.
+ *
+ * A message that an alarm stops using while it stays live (see
+ * alarm_change) is retired the same way, on its own.
+ *
+ * An alarm that moves to a new place in the list while staying
+ * live (a periodic alarm being rescheduled, or a changed one) could
+ * make a reader standing on it skip ahead. Writers count such moves in the
+ * shard's "moves" before relinking, and a reader that finds the
+ * count changed during its walk starts over.
+ */
+#define EPOCH_READERS   64      /* concurrent lock-free readers */
+#define EPOCH_BATCH     32      /* retired alarms per reclaim attempt */
+
+typedef struct epoch_slot_tag {
+    unsigned long       epoch;  /* 0 when the slot is quiescent */
+    int                 busy;
+    char                pad[64 - sizeof (unsigned long) - sizeof (int)];
+} epoch_slot_t;
+
+typedef struct retired_tag {
+    alarm_ref_t         alarm;  /* 0 if only "message" is retired */
+    msg_ref_t           message;
+    unsigned long       epoch;
+} retired_t;
+
+typedef struct epoch_state_tag {
+    unsigned long       global;
+    epoch_slot_t        slots[EPOCH_READERS];
+} epoch_state_t;
+
+static epoch_state_t epoch_local = { 1 };
+static epoch_state_t *epoch_state = &epoch_local;
+
+/*
+ * One line of a View_Alarms snapshot. The message is copied, since
+ * the alarm it came from may expire and be freed while the snapshot
+ * is still being printed.
+ */
+typedef struct view_entry_tag {
+    int                 order;  /* position in the walk, breaks ties */
+    int                 id_alarm;
+    int                 id_group;
+    int                 seconds;
+    time_t              time;
+    char                message[MSG_MAX + 1];
+} view_entry_t;
+
+#define VIEW_CHUNK 64           /* entries written per sink call */
+#define VIEW_LINE_MAX (MSG_MAX + 96)
+#define VIEW_RETRIES 3          /* walks before accepting a moving list */
+
+#define ALARM_HUGE_PAGE (2 << 20)       /* preallocated arenas round to this */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()     __builtin_ia32_pause ()
+#elif defined(__aarch64__)
+#define cpu_relax()     __asm__ __volatile__ ("yield")
+#else
+#define cpu_relax()     ((void)0)
+#endif
+
+/*
+ * A preallocated alarm store is one mapping holding everything the
+ * shards share: this header, the shards themselves, the alarm pool
+ * (hot and cold parts), the retired lists, the admission tables, the
+ * id index and the message store, in that order. It is either private to the process, or a shared
+ * memory object that other processes attach to (alarm_share and
+ * alarm_attach), which then insert alarms and walk the lists just
+ * as another thread would. Since the store holds pointers into
+ * itself, every process maps it at the same address, "base".
+ */
+#define STORE_MAGIC     0x53524c41u     /* "ALRS" */
+
+typedef struct alarm_store_tag {
+    uint32_t            magic;          /* set once it is ready */
+    int                 shards;
+    uint32_t            capacity;
+    size_t              size;
+    char                *base;
+    sem_t               sem_start_alarm;
+    sem_t               sem_display_threads;
+    epoch_state_t       epoch;
+} alarm_store_t;
+
+#define STORE_ALIGN(size)       (((size) + 63) & ~(size_t)63)
+
+static alarm_store_t *alarm_store = NULL;
+
+/*
+ * Set up one shard. The mutex and condition variable of a store in
+ * shared memory must work across processes.
+ */
+static void alarm_shard_init (alarm_shard_t *shard, int shared)
+{
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+    int status;
+
+    pthread_mutexattr_init (&mutex_attr);
+    pthread_condattr_init (&cond_attr);
+    if (shared) {
+        pthread_mutexattr_setpshared (&mutex_attr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setpshared (&cond_attr, PTHREAD_PROCESS_SHARED);
+    }
+    status = pthread_mutex_init (&shard->mutex, &mutex_attr);
+    if (status != 0) err_abort (status, "Init mutex");
+    pthread_condattr_setclock (&cond_attr, CLOCK_MONOTONIC);
+    status = pthread_cond_init (&shard->cond, &cond_attr);
+    if (status != 0) err_abort (status, "Init cond");
+    pthread_mutexattr_destroy (&mutex_attr);
+    pthread_condattr_destroy (&cond_attr);
+}
+
+/*
+ * Lay a store for "shards" shards and "capacity" alarms out at
+ * "base", and point our globals into it. Returns the size of the
+ * store; with a NULL base, nothing else is done. With "create", the
+ * store is also initialized, as a shared one if "shared" is set.
+ */
+static size_t alarm_store_layout (char *base, int shards, uint32_t capacity,
+    int create, int shared)
+{
+    alarm_ref_t slice = (capacity + shards - 1) / shards;
+    size_t entries = (size_t)slice * shards + 1;
+    size_t top, pool, cold, retired, admit, ids, msg;
+    int i;
+
+    top = STORE_ALIGN(sizeof (alarm_store_t));
+    top += STORE_ALIGN(shards * sizeof (alarm_shard_t));
+    pool = top;
+    top += STORE_ALIGN(entries * sizeof (alarm_t));
+    cold = top;
+    top += STORE_ALIGN(entries * sizeof (alarm_cold_t));
+    retired = top;
+    top += STORE_ALIGN(entries * 2 * sizeof (retired_t));
+    admit = top;
+    top += STORE_ALIGN(admit_space (shards, capacity));
+    ids = top;
+    top += STORE_ALIGN(ids_space (shards, capacity));
+    msg = top;
+    top += msg_space (shards, capacity);
+    top = (top + ALARM_HUGE_PAGE - 1) & ~(size_t)(ALARM_HUGE_PAGE - 1);
+    if (base == NULL)
+        return top;
+
+    alarm_store = (alarm_store_t*)base;
+    alarm_shards = (alarm_shard_t*)(base + STORE_ALIGN(sizeof (alarm_store_t)));
+    alarm_shard_count = shards;
+    alarm_pool = (alarm_t*)(base + pool);
+    alarm_cold = (alarm_cold_t*)(base + cold);
+    epoch_state = &alarm_store->epoch;
+    sem_start_alarm = &alarm_store->sem_start_alarm;
+    sem_display_threads = &alarm_store->sem_display_threads;
+    msg_init (base + msg, shards, capacity, !create);
+    admit_init (base + admit, shards, capacity, !create);
+    ids_init (base + ids, shards, capacity, !create, shared);
+    if (!create)
+        return top;
+
+    alarm_store->shards = shards;
+    alarm_store->capacity = capacity;
+    alarm_store->size = top;
+    alarm_store->base = base;
+    alarm_store->epoch.global = 1;
+    sem_init (sem_start_alarm, shared, 0);
+    sem_init (sem_display_threads, shared, 0);
+    for (i = 0; i < shards; i++) {
+        alarm_shard_init (&alarm_shards[i], shared);
+        alarm_shards[i].pool_top = 1 + i * slice;      /* entry 0 is never used */
+        alarm_shards[i].pool_end = 1 + (i + 1) * slice;
+        alarm_shards[i].retired = (retired_t*)(base + retired) + i * 2 * slice;
+        alarm_shards[i].retired_size = 2 * slice;       /* see retire */
+        alarm_shards[i].msg = msg_heap (i);
+        alarm_shards[i].admit = admit_table (i);
+    }
+    return top;
+}
+
+/*
+ * NUMA placement. Shard i belongs to the i'th online node, round
+ * robin. With ALARM_ARENA_NUMA, everything that only the shard
+ * touches (its slices of the alarm pool and of the retired lists,
+ * and its message heap) is asked to come from that node, and
+ * alarm_numa_place can put the shard's alarm thread on it, so an
+ * alarm is allocated, walked and fired in memory local to the
+ * thread that fires it, whichever intake thread inserted it. There
+ * is no libnuma dependency: nodes are read from sysfs and memory
+ * is bound with the mbind system call.
+ */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
+#define NUMA_NODES_MAX  1024
+
+static thread_place_t numa_nodes;       /* online node numbers */
+
+static void alarm_numa_init (void)
+{
+    char list[4096];
+    FILE *file;
+
+    if (numa_nodes.cpu_count > 0)
+        return;
+    file = fopen ("/sys/devices/system/node/online", "r");
+    if (file != NULL) {
+        if (fgets (list, sizeof (list), file) != NULL) {
+            list[strcspn (list, "\n")] = '\0';
+            if (thread_place_parse (&numa_nodes, list) < 0)
+                numa_nodes.cpu_count = 0;
+        }
+        fclose (file);
+    }
+    if (numa_nodes.cpu_count == 0) {
+        numa_nodes.cpu_count = 1;       /* not NUMA: node 0 only */
+        numa_nodes.cpus[0] = 0;
+    }
+}
+
+int alarm_numa_node (int shard)
+{
+    alarm_numa_init ();
+    return numa_nodes.cpus[shard % numa_nodes.cpu_count];
+}
+
+/*
+ * Prefer NUMA node "node" for the whole pages in the given range
+ * that have not been touched yet.
+ */
+void alarm_numa_bind (void *start, size_t size, int node)
+{
+    unsigned long mask[NUMA_NODES_MAX / (8 * sizeof (unsigned long))];
+    uintptr_t first = ((uintptr_t)start + 4095) & ~(uintptr_t)4095;
+    uintptr_t last = ((uintptr_t)start + size) & ~(uintptr_t)4095;
+
+    if (last <= first || node >= NUMA_NODES_MAX)
+        return;
+    memset (mask, 0, sizeof (mask));
+    mask[node / (8 * sizeof (unsigned long))] |= 1UL << (node % (8 * sizeof (unsigned long)));
+    if (syscall (SYS_mbind, first, last - first, MPOL_PREFERRED, mask,
+            NUMA_NODES_MAX, 0) < 0 && errno != ENOSYS)
+        fprintf (stderr, "Cannot bind memory to node %d: %s\n",
+            node, strerror (errno));
+}
+
+/*
+ * Bind every shard's memory to the shard's node.
+ */
+static void alarm_numa_bind_shards (void)
+{
+    alarm_shard_t *shard;
+    int i, node;
+
+    for (i = 0; i < alarm_shard_count; i++) {
+        shard = &alarm_shards[i];
+        node = alarm_numa_node (i);
+        alarm_numa_bind (ALARM(shard->pool_top),
+            (shard->pool_end - shard->pool_top) * sizeof (alarm_t), node);
+        alarm_numa_bind (ALARM_COLD(shard->pool_top),
+            (shard->pool_end - shard->pool_top) * sizeof (alarm_cold_t), node);
+        if (shard->retired != NULL)
+            alarm_numa_bind (shard->retired,
+                shard->retired_size * sizeof (retired_t), node);
+        msg_bind (i, node);
+    }
+}
+
+/*
+ * Fill in "place" so that the i'th of "threads" alarm threads runs
+ * on a CPU of shard i's node, the threads of one node taking its
+ * CPUs in turn. Returns -1 if the CPUs of a node cannot be read.
+ */
+int alarm_numa_place (thread_place_t *place, int threads)
+{
+    thread_place_t *cpus;
+    char path[64], list[4096];
+    FILE *file;
+    int i, node, status = 0;
+
+    alarm_numa_init ();
+    cpus = (thread_place_t*)calloc (numa_nodes.cpu_count, sizeof (thread_place_t));
+    if (cpus == NULL) errno_abort ("Allocate NUMA nodes");
+    for (i = 0; i < numa_nodes.cpu_count && status == 0; i++) {
+        snprintf (path, sizeof (path), "/sys/devices/system/node/node%d/cpulist",
+            numa_nodes.cpus[i]);
+        file = fopen (path, "r");
+        if (file == NULL || fgets (list, sizeof (list), file) == NULL)
+            status = -1;
+        else {
+            list[strcspn (list, "\n")] = '\0';
+            status = thread_place_parse (&cpus[i], list);
+        }
+        if (file != NULL)
+            fclose (file);
+    }
+    if (status == 0) {
+        place->cpu_count = threads < THREAD_CPUS_MAX ? threads : THREAD_CPUS_MAX;
+        for (i = 0; i < place->cpu_count; i++) {
+            node = i % numa_nodes.cpu_count;
+            place->cpus[i] = cpus[node].cpus[
+                (i / numa_nodes.cpu_count) % cpus[node].cpu_count];
+        }
+    }
+    free (cpus);
+    return status;
+}
+
+/*
+ * Ask for huge pages for a store, if that is what "flags" say,
+ * before anything in it is touched. A store in shared memory can
+ * only have transparent huge pages.
+ */
+static void alarm_store_advise (char *base, size_t size, int flags)
+{
+    if ((flags & ALARM_ARENA_HUGE) && madvise (base, size, MADV_HUGEPAGE) < 0)
+        fprintf (stderr, "No transparent huge pages: %s\n", strerror (errno));
+}
+
+/*
+ * Fault in every page of a store now, and lock it into memory if
+ * asked for, so that a burst of alarms later never waits for the
+ * kernel. The store has already been laid out (and perhaps bound to
+ * NUMA nodes), so each page is written with what it holds.
+ */
+static void alarm_store_fault (char *base, size_t size, int flags)
+{
+    volatile char *page;
+    size_t offset;
+
+    for (offset = 0; offset < size; offset += 4096) {
+        page = base + offset;
+        *page = *page;
+    }
+    if ((flags & ALARM_ARENA_LOCK) && mlock (base, size) < 0)
+        fprintf (stderr, "Cannot lock alarm store: %s\n", strerror (errno));
+}
+
+/*
+ * Set up "shards" shards, and the alarm pool (hot and cold parts)
+ * and the message arena for them. Must be called (or alarm_share or
+ * alarm_attach) before any other routine in this file.
+ *
+ * With a "capacity" of 0, address space for ALARM_POOL_MAX alarms
+ * is reserved and only backed by memory as it is used. Otherwise
+ * everything is laid out in one private store sized for "capacity"
+ * alarms (and as many messages), on huge pages if there are any
+ * (ALARM_ARENA_HUGE), and faulted in at once (see
+ * alarm_store_fault). Either way each shard gets an equal slice of
+ * the pool, which ALARM_ARENA_NUMA places on the shard's NUMA node
+ * (see alarm_numa_bind_shards).
+ */
+void alarm_init (int shards, uint32_t capacity, int flags)
+{
+    alarm_ref_t slice;
+    char *base = MAP_FAILED;
+    size_t size;
+    int i;
+
+    if (capacity > ALARM_POOL_MAX - shards)
+        capacity = ALARM_POOL_MAX - shards;
+    if (capacity != 0) {
+        size = alarm_store_layout (NULL, shards, capacity, 1, 0);
+        if (flags & ALARM_ARENA_HUGE) {
+            base = (char*)mmap (NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (base == MAP_FAILED)
+                fprintf (stderr, "No huge pages reserved (%s); "
+                    "asking for transparent huge pages\n", strerror (errno));
+            else
+                flags &= ~ALARM_ARENA_HUGE;
+        }
+        if (base == MAP_FAILED) {
+            base = (char*)mmap (NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED) errno_abort ("Map alarm store");
+        }
+        alarm_store_advise (base, size, flags);
+        alarm_store_layout (base, shards, capacity, 1, 0);
+        if (flags & ALARM_ARENA_NUMA)
+            alarm_numa_bind_shards ();
+        alarm_store_fault (base, size, flags);
+        return;
+    }
+
+    slice = (ALARM_POOL_MAX - 1) / shards;
+    alarm_pool = (alarm_t*)mmap (NULL, ALARM_POOL_MAX * sizeof (alarm_t),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0);
+    if (alarm_pool == MAP_FAILED) errno_abort ("Reserve alarm pool");
+    alarm_cold = (alarm_cold_t*)mmap (NULL,
+        ALARM_POOL_MAX * sizeof (alarm_cold_t),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0);
+    if (alarm_cold == MAP_FAILED) errno_abort ("Reserve alarm pool");
+    msg_init (NULL, shards, 0, 0);
+    admit_init (NULL, shards, 0, 0);
+    ids_init (NULL, shards, 0, 0, 0);
+    sem_init (sem_start_alarm, 0, 0);
+    sem_init (sem_display_threads, 0, 0);
+
+    alarm_shards = (alarm_shard_t*)aligned_alloc (64, shards * sizeof (alarm_shard_t));
+    if (alarm_shards == NULL) errno_abort ("Allocate shards");
+    memset (alarm_shards, 0, shards * sizeof (alarm_shard_t));
+    for (i = 0; i < shards; i++) {
+        alarm_shard_init (&alarm_shards[i], 0);
+        alarm_shards[i].pool_top = 1 + i * slice;      /* entry 0 is never used */
+        alarm_shards[i].pool_end = 1 + (i + 1) * slice;
+        alarm_shards[i].msg = msg_heap (i);
+        alarm_shards[i].admit = admit_table (i);
+    }
+    alarm_shard_count = shards;
+    if (flags & ALARM_ARENA_NUMA)
+        alarm_numa_bind_shards ();
+}
+
+/*
+ * Create the alarm store as the shared memory object "name" (as
+ * for shm_open, e.g. "/alarms"), replacing any old one, and set up
+ * the scheduler in it as alarm_init would. Returns -1, having said
+ * why, if the object cannot be created.
+ */
+int alarm_share (const char *name, int shards, uint32_t capacity, int flags)
+{
+    char *base;
+    size_t size;
+    int fd;
+
+    if (capacity == 0 || capacity > ALARM_POOL_MAX - shards) {
+        fprintf (stderr, "A shared alarm store needs a capacity of 1 to %u\n",
+            ALARM_POOL_MAX - shards);
+        return -1;
+    }
+    size = alarm_store_layout (NULL, shards, capacity, 1, 1);
+    shm_unlink (name);
+    fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 || ftruncate (fd, size) < 0) {
+        perror (name);
+        return -1;
+    }
+    base = (char*)mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (base == MAP_FAILED) {
+        perror (name);
+        return -1;
+    }
+    alarm_store_advise (base, size, flags);
+    alarm_store_layout (base, shards, capacity, 1, 1);
+    if (flags & ALARM_ARENA_NUMA)
+        alarm_numa_bind_shards ();
+    alarm_store_fault (base, size, flags);
+    __atomic_store_n (&alarm_store->magic, STORE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Attach to the shared alarm store "name" created by another
+ * process, which runs its alarm threads. Alarms can then be
+ * inserted and viewed from here too; a "readonly" attachment can
+ * only view them, and does so without joining the epoch scheme, so
+ * it never holds up reclamation (see alarm_view). Returns -1,
+ * having said why, if the store cannot be mapped.
+ */
+int alarm_attach (const char *name, int readonly)
+{
+    alarm_store_t *header;
+    char *base;
+    size_t size;
+    int fd, shards;
+    uint32_t capacity;
+    int prot = readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+
+    fd = shm_open (name, readonly ? O_RDONLY : O_RDWR, 0);
+    if (fd < 0) {
+        perror (name);
+        return -1;
+    }
+    header = (alarm_store_t*)mmap (NULL, sizeof (alarm_store_t), PROT_READ,
+        MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror (name);
+        close (fd);
+        return -1;
+    }
+    if (__atomic_load_n (&header->magic, __ATOMIC_ACQUIRE) != STORE_MAGIC) {
+        fprintf (stderr, "%s: not an alarm store\n", name);
+        munmap (header, sizeof (alarm_store_t));
+        close (fd);
+        return -1;
+    }
+    base = header->base;
+    size = header->size;
+    shards = header->shards;
+    capacity = header->capacity;
+    munmap (header, sizeof (alarm_store_t));
+    if (mmap (base, size, prot, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0)
+        != base) {
+        fprintf (stderr, "%s: cannot map the store at %p\n", name, base);
+        close (fd);
+        return -1;
+    }
+    close (fd);
+    alarm_readonly = readonly;
+    alarm_store_layout (base, shards, capacity, 0, 1);
+    return 0;
+}
+
+/*
+ * Allocate and free pool entries.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * These routines require that the caller have locked the shard's
+ * mutex!
+ */
+alarm_ref_t alarm_alloc (alarm_shard_t *shard)
+{
+    alarm_ref_t ref = shard->pool_free;
+
+    if (ref != 0)
+        shard->pool_free = ALARM(ref)->link;
+    else {
+        if (shard->pool_top == shard->pool_end)
+            err_abort (ENOMEM, "Alarm pool full");
+        ref = shard->pool_top++;
+    }
+    return ref;
+}
+
+void alarm_free (alarm_shard_t *shard, alarm_ref_t ref)
+{
+    __atomic_add_fetch (&ALARM_COLD(ref)->generation, 1, __ATOMIC_RELEASE);
+    ALARM(ref)->link = shard->pool_free;
+    shard->pool_free = ref;
+}
+
+/*
+ * Begin a read-side critical section; returns the slot to pass to
+ * epoch_exit. Alarms reached from a shard list stay valid until then.
+ * A read-only attachment (see alarm_attach) cannot announce itself,
+ * and gets -1 and no such promise.
+ */
+int epoch_enter (void)
+{
+    unsigned long epoch;
+    int slot;
+
+    if (alarm_readonly)
+        return -1;
+
+    for (slot = 0; ; slot = (slot + 1) % EPOCH_READERS) {
+        if (__atomic_load_n (&epoch_state->slots[slot].busy, __ATOMIC_RELAXED) == 0
+            && __atomic_exchange_n (
+                &epoch_state->slots[slot].busy, 1, __ATOMIC_ACQUIRE) == 0)
+            break;
+        if (slot == EPOCH_READERS - 1)
+            sched_yield ();
+    }
+    /*
+     * Publish the epoch and check it did not move while we did so;
+     * otherwise a writer may have missed us when advancing.
+     */
+    do {
+        epoch = __atomic_load_n (&epoch_state->global, __ATOMIC_SEQ_CST);
+        __atomic_store_n (&epoch_state->slots[slot].epoch, epoch, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n (&epoch_state->global, __ATOMIC_SEQ_CST) != epoch);
+    return slot;
+}
+
+void epoch_exit (int slot)
+{
+    if (slot < 0)
+        return;
+    __atomic_store_n (&epoch_state->slots[slot].epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n (&epoch_state->slots[slot].busy, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Try to advance the global epoch, and free every retired alarm
+ * (and its message) and message of the shard that no reader can
+ * observe any more.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the shard's
+ * mutex!
+ */
+void epoch_reclaim (alarm_shard_t *shard)
+{
+    unsigned long epoch, reader;
+    int slot, i, kept;
+
+    epoch = __atomic_load_n (&epoch_state->global, __ATOMIC_SEQ_CST);
+    for (slot = 0; slot < EPOCH_READERS; slot++) {
+        reader = __atomic_load_n (&epoch_state->slots[slot].epoch, __ATOMIC_SEQ_CST);
+        if (reader != 0 && reader != epoch)
+            break;
+    }
+    if (slot == EPOCH_READERS
+        && __atomic_compare_exchange_n (&epoch_state->global, &epoch, epoch + 1,
+            0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        epoch++;
+    kept = 0;
+    for (i = 0; i < shard->retired_count; i++) {
+        if (shard->retired[i].epoch + 2 > epoch)
+            shard->retired[kept++] = shard->retired[i];
+        else if (shard->retired[i].alarm == 0)
+            msg_release (shard->msg, shard->retired[i].message);
+        else {
+            msg_release (shard->msg, ALARM(shard->retired[i].alarm)->message);
+            alarm_free (shard, shard->retired[i].alarm);
+        }
+    }
+    shard->retired_count = kept;
+}
+
+/*
+ * Put an alarm, or with "ref" 0 just a message, on the shard's
+ * retired list.
+ *
+ * The retired list of a preallocated store cannot grow. It has
+ * room for every alarm of the shard and as many messages again,
+ * which only runs out if alarms keep changing their message while
+ * a reader holds up the epoch; we then wait for the reader.
+ *
+ * The store that unlinked the entry must be seq_cst, like the load
+ * of the epoch here. A release store may be ordered after that
+ * load, so the entry could be stamped with an epoch older than the
+ * one a reader entered while it could still find the entry, and
+ * be freed under that reader. (A fence would do as well, but
+ * ThreadSanitizer does not support fences.)
+ */
+static void retire (alarm_shard_t *shard, alarm_ref_t ref, msg_ref_t message)
+{
+    while (shard->retired_count == shard->retired_size) {
+        if (alarm_store == NULL) {
+            shard->retired_size = shard->retired_size
+                ? shard->retired_size * 2 : EPOCH_BATCH * 2;
+            shard->retired = (retired_t*)realloc (
+                shard->retired, shard->retired_size * sizeof (retired_t));
+            if (shard->retired == NULL) errno_abort ("Allocate retired list");
+            break;
+        }
+        epoch_reclaim (shard);
+        if (shard->retired_count == shard->retired_size)
+            sched_yield ();
+    }
+    shard->retired[shard->retired_count].alarm = ref;
+    shard->retired[shard->retired_count].message = message;
+    shard->retired[shard->retired_count].epoch =
+        __atomic_load_n (&epoch_state->global, __ATOMIC_SEQ_CST);
+    shard->retired_count++;
+    if (shard->retired_count % EPOCH_BATCH == 0)
+        epoch_reclaim (shard);
+}
+
+/*
+ * Hand an alarm that has been unlinked from its shard's list over
+ * to epoch reclamation instead of freeing it. It no longer counts
+ * against the admission limits, and its id is free for a new alarm.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the shard's
+ * mutex!
+ */
+void alarm_retire (alarm_shard_t *shard, alarm_ref_t ref)
+{
+    alarm_release (shard, ALARM(ref)->id_group);
+    alarm_id_remove (ALARM(ref)->id_alarm, ALARM_HANDLE(ref));
+    retire (shard, ref, 0);
+}
+
+/*
+ * The virtual clock. While "alarm_virtual" is set, both clocks stand
+ * still, virtual_offset apart, except when alarm_clock_advance moves
+ * them, and the alarm threads wait for that instead of for time to
+ * pass. Without ALARM_VIRTUAL_CLOCK, alarm_virtual is always 0.
+ */
+#if ALARM_VIRTUAL_CLOCK
+int alarm_virtual = 0;
+#endif
+static int64_t virtual_now;             /* stands in for CLOCK_MONOTONIC */
+static int64_t virtual_offset;          /* CLOCK_REALTIME ahead of it */
+
+/*
+ * Read the virtual clock, or, if "virtual" is 0, the real one. The
+ * alarm thread calls this with "virtual" a constant.
+ */
+static inline int64_t alarm_clock_read (int virtual, int wall)
+{
+    struct timespec now;
+
+    if (virtual)
+        return __atomic_load_n (&virtual_now, __ATOMIC_ACQUIRE)
+            + (wall ? virtual_offset : 0);
+    clock_gettime (wall ? CLOCK_REALTIME : CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * The current time on CLOCK_MONOTONIC, or with "wall", since the
+ * Epoch, in nanoseconds.
+ */
+int64_t alarm_now_ns (int wall)
+{
+    return alarm_clock_read (alarm_virtual, wall);
+}
+
+/*
+ * The current time in seconds on the clock of an alarm (see
+ * alarm_t), for working out its "time".
+ */
+time_t alarm_clock (int wall)
+{
+    return alarm_now_ns (wall) / 1000000000;
+}
+
+/*
+ * How far CLOCK_REALTIME is ahead of CLOCK_MONOTONIC, in ns.
+ */
+static int64_t alarm_wall_offset (void)
+{
+    int64_t mono = alarm_now_ns (0);
+
+    return alarm_now_ns (1) - mono;
+}
+
+/*
+ * The deadline of an alarm on CLOCK_MONOTONIC, in ns, given the
+ * current alarm_wall_offset (which only wall-clock alarms need).
+ */
+static inline int64_t alarm_deadline (alarm_ref_t ref, int64_t offset)
+{
+    int64_t deadline = (int64_t)ALARM(ref)->time * 1000000000;
+
+    return ALARM_COLD(ref)->wall ? deadline - offset : deadline;
+}
+
+/*
+ * alarm_wall_offset in whole seconds, rounded, for turning the
+ * "time" of an alarm on CLOCK_MONOTONIC into seconds since the
+ * Epoch. Every time shown to users goes through it, so that a reply
+ * and a view agree on when an alarm is due.
+ */
+static time_t alarm_epoch_offset (void)
+{
+    return (alarm_wall_offset () + 500000000) / 1000000000;
+}
+
+/*
+ * The time an alarm is due, in seconds since the Epoch, for showing
+ * it to users.
+ */
+time_t alarm_epoch (alarm_ref_t ref)
+{
+    if (ALARM_COLD(ref)->wall)
+        return ALARM(ref)->time;
+    return ALARM(ref)->time + alarm_epoch_offset ();
+}
+
+/*
+ * The list an alarm belongs on.
+ */
+static inline alarm_ref_t *alarm_list (alarm_shard_t *shard, alarm_ref_t ref)
+{
+    return &shard->list[ALARM_COLD(ref)->wall
+        ? ALARM_WALL : ALARM_COLD(ref)->priority];
+}
+
+/*
+ * Make an alarm thread look at its lists again, if the alarm due at
+ * "deadline" (in ns on CLOCK_MONOTONIC) comes before the one it is
+ * waiting for, or it is not busy (that is, if current_alarm is 0,
+ * signifying that it's waiting for work).
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the shard's
+ * mutex!
+ */
+static void alarm_wake (alarm_shard_t *shard, int64_t deadline)
+{
+    int status;
+
+    if (shard->current_alarm == 0 || deadline < shard->current_alarm) {
+        __atomic_store_n (&shard->current_alarm, deadline, __ATOMIC_RELAXED);
+        status = pthread_cond_signal (&shard->cond);
+        if (status != 0) err_abort (status, "Signal cond");
+    }
+}
+
+/*
+ * Make a shard's alarm thread work out its deadline again, after
+ * the clocks have moved under it.
+ */
+static void alarm_kick (alarm_shard_t *shard)
+{
+    int status;
+
+    status = pthread_mutex_lock (&shard->mutex);
+    if (status != 0) err_abort (status, "Lock mutex");
+    __atomic_store_n (&shard->current_alarm, 0, __ATOMIC_RELAXED);
+    status = pthread_cond_signal (&shard->cond);
+    if (status != 0) err_abort (status, "Signal cond");
+    status = pthread_mutex_unlock (&shard->mutex);
+    if (status != 0) err_abort (status, "Unlock mutex");
+}
+
+/*
+ * The trace policy (ALARM_TRACE): with it off, these compile to
+ * nothing.
+ */
+static inline void alarm_trace_list (alarm_shard_t *shard, alarm_ref_t ref)
+{
+    alarm_ref_t next;
+
+    if (!ALARM_TRACE)
+        return;
+    printf ("[list %ld: ", (long)(alarm_list (shard, ref) - shard->list));
+    for (next = *alarm_list (shard, ref); next != 0;
+         next = ALARM(next)->link)
+        printf ("%ld(%ld)[\"%s\"] ", ALARM(next)->time,
+            ALARM(next)->time - alarm_clock (ALARM_COLD(ref)->wall),
+            MSG_TEXT(ALARM(next)->message));
+    printf ("]\n");
+}
+
+static inline void alarm_trace_wait (int64_t deadline, int64_t now)
+{
+    if (!ALARM_TRACE)
+        return;
+    printf ("[waiting: %ld(%ld)]\n", (long)(deadline / 1000000000),
+        (long)((deadline - now) / 1000000000));
+}
+
+/*
+ * Insert alarm entry on its shard's list for its class (or the list
+ * of wall-clock alarms), in order.
+ */
+void alarm_insert (alarm_shard_t *shard, alarm_ref_t ref)
+{
+    alarm_t *alarm = ALARM(ref);
+    alarm_ref_t *last, next;
+
+    /*
+     * LOCKING PROTOCOL:
+     *
+     * This routine requires that the caller have locked the
+     * shard's mutex!
+     */
+    last = alarm_list (shard, ref);
+    next = *last;
+    while (next != 0) {
+        if (ALARM(next)->time >= alarm->time) {
+            __atomic_store_n (&alarm->link, next, __ATOMIC_RELEASE);
+            __atomic_store_n (last, ref, __ATOMIC_RELEASE);
+            break;
+        }
+        last = &ALARM(next)->link;
+        next = *last;
+    }
+    /*
+     * If we reached the end of the list, insert the new alarm
+     * there.  ("next" is 0, and "last" points to the link
+     * field of the last item, or to the list header.)
+     */
+    if (next == 0) {
+        __atomic_store_n (&alarm->link, 0, __ATOMIC_RELEASE);
+        __atomic_store_n (last, ref, __ATOMIC_RELEASE);
+    }
+    alarm_trace_list (shard, ref);
+    alarm_wake (shard, alarm_deadline (ref,
+        ALARM_COLD(ref)->wall ? alarm_wall_offset () : 0));
+}
+
+/*
+ * Parse a list of CPUs such as "2,4-7" into "place". Returns 0, or
+ * -1 if the list is not valid.
+ */
+int thread_place_parse (thread_place_t *place, const char *list)
+{
+    char *end;
+    long first, last;
+
+    place->cpu_count = 0;
+    while (*list != '\0') {
+        first = last = strtol (list, &end, 10);
+        if (end == list)
+            return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol (list, &end, 10);
+            if (end == list)
+                return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE
+            || place->cpu_count + (last - first + 1) > THREAD_CPUS_MAX)
+            return -1;
+        while (first <= last)
+            place->cpus[place->cpu_count++] = first++;
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        list = end;
+    }
+    return place->cpu_count > 0 ? 0 : -1;
+}
+
+/*
+ * Create a thread placed as "place" says for the index'th thread of
+ * its kind. If the system will not let us use SCHED_FIFO (it takes
+ * privilege), say so and run the thread at the normal priority
+ * instead, still pinned. Returns the pthread_create status.
+ */
+int thread_create (pthread_t *thread, const thread_place_t *place,
+    int index, void *(*start) (void *), void *arg)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    cpu_set_t cpus;
+    int status;
+
+    status = pthread_attr_init (&attr);
+    if (status != 0) err_abort (status, "Init thread attributes");
+    if (place->cpu_count > 0) {
+        CPU_ZERO (&cpus);
+        CPU_SET (place->cpus[index % place->cpu_count], &cpus);
+        status = pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+        if (status != 0) err_abort (status, "Set thread affinity");
+    }
+    if (place->priority > 0) {
+        param.sched_priority = place->priority;
+        pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+        status = pthread_attr_setschedparam (&attr, &param);
+        if (status != 0) err_abort (status, "Set thread priority");
+    }
+    status = pthread_create (thread, &attr, start, arg);
+    if (status == EPERM && place->priority > 0) {
+        fprintf (stderr, "Not permitted to use SCHED_FIFO;"
+            " running at normal priority\n");
+        pthread_attr_setinheritsched (&attr, PTHREAD_INHERIT_SCHED);
+        status = pthread_create (thread, &attr, start, arg);
+    }
+    pthread_attr_destroy (&attr);
+    return status;
+}
+
+/*
+ * Place the calling thread, which was not created by thread_create,
+ * as the index'th thread of its kind.
+ */
+void thread_place_self (const thread_place_t *place, int index)
+{
+    cpu_set_t cpus;
+    int status;
+
+    if (place->cpu_count == 0)
+        return;
+    CPU_ZERO (&cpus);
+    CPU_SET (place->cpus[index % place->cpu_count], &cpus);
+    status = pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus);
+    if (status != 0) err_abort (status, "Set thread affinity");
+}
+
+/*
+ * Wait for a deadline less than alarm_spin_ns away by spinning
+ * rather than sleeping: waking from pthread_cond_timedwait costs a
+ * trip through the scheduler, which is most of the firing latency
+ * of an alarm that is due right away. The mutex is released while
+ * we spin, and the spin ends early if an earlier alarm is inserted
+ * (current_alarm changes), so that it is looked at first.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the shard's
+ * mutex, and returns with it locked again.
+ */
+static void alarm_spin (alarm_shard_t *shard, int64_t deadline)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&shard->mutex);
+    if (status != 0) err_abort (status, "Unlock mutex");
+    while (alarm_clock_read (0, 0) < deadline
+        && __atomic_load_n (&shard->current_alarm, __ATOMIC_RELAXED) == deadline)
+        cpu_relax ();
+    status = pthread_mutex_lock (&shard->mutex);
+    if (status != 0) err_abort (status, "Lock mutex");
+    __atomic_store_n (&shard->wakeups, shard->wakeups + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Decide when the alarm thread should next wake up, given that no
+ * alarm at the head of a class list is due yet. Each alarm may be
+ * fired up to its "slack" seconds late, so rather than waking for
+ * every distinct deadline, the thread wakes at the last moment that
+ * is still within the slack of every alarm due by then:
+ * the earliest deadline-plus-slack among the alarms due before it.
+ * All of those alarms then fire together, whatever their class.
+ * Since that moment only moves earlier, each list is walked in
+ * turn, up to the first alarm due after it, so the walk visits no
+ * more alarms than the wakeup will fire. The moment is returned in
+ * ns on CLOCK_MONOTONIC.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the shard's
+ * mutex!
+ */
+static int64_t alarm_coalesce (alarm_shard_t *shard, int64_t offset)
+{
+    alarm_ref_t ref;
+    int64_t wake = 0, deadline, end;
+    int class;
+
+    for (class = 0; class <= ALARM_WALL; class++) {
+        for (ref = shard->list[class]; ref != 0; ref = ALARM(ref)->link) {
+            deadline = alarm_deadline (ref, offset);
+            if (wake != 0 && deadline > wake)
+                break;
+            end = deadline + (int64_t)ALARM_COLD(ref)->slack * 1000000000;
+            if (wake == 0 || end < wake)
+                wake = end;
+        }
+    }
+    return wake;
+}
+
+/*
+ * Add up the wakeups of all alarm threads, and the alarms they
+ * fired.
+ */
+void alarm_wakeups (uint64_t *wakeups, uint64_t *fired)
+{
+    int i;
+
+    *wakeups = *fired = 0;
+    for (i = 0; i < alarm_shard_count; i++) {
+        *wakeups += __atomic_load_n (&alarm_shards[i].wakeups, __ATOMIC_RELAXED);
+        *fired += __atomic_load_n (&alarm_shards[i].fired, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Count how late an alarm was fired, past its deadline plus its
+ * slack, in the shard's latency histogram for its class: bucket 0
+ * holds latencies below a microsecond (and alarms fired early to
+ * coalesce them), and bucket i > 0 those from 2^(i-1) up to 2^i
+ * microseconds.
+ */
+static void alarm_latency_record (alarm_shard_t *shard, int class,
+    int64_t late)
+{
+    int bucket = 0;
+
+    late /= 1000;
+    while (late > 0 && bucket < ALARM_LATENCY_BUCKETS - 1) {
+        late >>= 1;
+        bucket++;
+    }
+    __atomic_add_fetch (&shard->latency[class][bucket], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add up the firing latency histograms of all shards for one
+ * priority class, or, if "priority" is negative, for all of them.
+ */
+void alarm_latency (int priority, uint64_t histogram[ALARM_LATENCY_BUCKETS])
+{
+    int i, j, class;
+
+    for (j = 0; j < ALARM_LATENCY_BUCKETS; j++)
+        histogram[j] = 0;
+    for (i = 0; i < alarm_shard_count; i++)
+        for (class = 0; class < ALARM_CLASSES; class++) {
+            if (priority >= 0 && class != priority)
+                continue;
+            for (j = 0; j < ALARM_LATENCY_BUCKETS; j++)
+                histogram[j] += __atomic_load_n (
+                    &alarm_shards[i].latency[class][j], __ATOMIC_RELAXED);
+        }
+}
+
+/*
+ * The alarm thread's loop, for a thread on the virtual clock if
+ * "virtual", and spinning before deadlines if "spin". It is inlined
+ * into alarm_group_display_creation once for each configuration,
+ * with both constant, so that neither is tested as the loop runs.
+ * "shard" is declared nonnull: otherwise, under
+ * -fsanitize=undefined, GCC follows a NULL shard through the checks
+ * on the pthread calls, and warns that the wakeup count is stored
+ * out of bounds.
+ */
+static inline __attribute__ ((always_inline, nonnull))
+void alarm_thread_loop (alarm_shard_t *shard, const int virtual, const int spin)
+{
+    alarm_t *alarm;
+    alarm_ref_t ref, *head;
+    struct timespec cond_time;
+    int64_t now, offset, deadline, wake;
+    char text[MSG_MAX + 16];
+    uint32_t owner;
+    int status, len, class;
+
+    /*
+     * Loop forever, processing commands. The alarm thread will
+     * be disintegrated when the process exits. Lock the mutex
+     * at the start -- it will be unlocked during condition
+     * waits, so the main thread can insert alarms.
+     */
+    status = pthread_mutex_lock (&shard->mutex); //LOCK MUTEX
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    while (1) {
+        /*
+         * If every alarm list is empty, wait until an alarm is
+         * added. Setting current_alarm to 0 informs the insert
+         * routine that the thread is not busy.
+         */
+        shard->current_alarm = 0;
+        if (alarm_shard_idle (shard) && shard->retired_count > 0)
+            epoch_reclaim (shard);
+        while (alarm_shard_idle (shard)) {
+            shard->waiting = 1;
+            status = pthread_cond_wait (&shard->cond, &shard->mutex);
+            shard->waiting = 0;
+            if (status != 0) err_abort (status, "Wait on cond");
+            __atomic_store_n (&shard->wakeups, shard->wakeups + 1, __ATOMIC_RELAXED);
+        }
+        /*
+         * The earliest alarms stay at the head of their lists while
+         * we wait for them, so that View_Alarms sees every pending
+         * alarm. If an earlier alarm is inserted meanwhile, the
+         * wait ends early and we simply look at the heads again.
+         * Of the alarms that are due, the highest class goes first;
+         * a wall-clock alarm goes before those of lower classes.
+         */
+        now = alarm_clock_read (virtual, 0);
+        offset = shard->list[ALARM_WALL] != 0
+            ? alarm_clock_read (virtual, 1) - alarm_clock_read (virtual, 0) : 0;
+        for (class = ALARM_CLASSES - 1; class >= 0; class--) {
+            ref = shard->list[class];
+            if (ref != 0 && alarm_deadline (ref, 0) <= now)
+                break;
+        }
+        head = class >= 0 ? &shard->list[class] : NULL;
+        ref = shard->list[ALARM_WALL];
+        if (ref != 0 && alarm_deadline (ref, offset) <= now
+            && ALARM_COLD(ref)->priority >= class) {
+            head = &shard->list[ALARM_WALL];
+            class = ALARM_COLD(ref)->priority;
+        }
+        if (class < 0) {
+            deadline = alarm_coalesce (shard, offset);
+            alarm_trace_wait (deadline, now);
+            __atomic_store_n (&shard->current_alarm, deadline,
+                __ATOMIC_RELAXED);
+            if (spin && deadline - now <= alarm_spin_ns) {
+                alarm_spin (shard, deadline);
+                continue;
+            }
+            /*
+             * Block until the deadline, or, if spinning is enabled,
+             * until just before it, and spin the rest of the way.
+             * On the virtual clock, block until the clock is moved.
+             */
+            wake = spin ? deadline - alarm_spin_ns : deadline;
+            cond_time.tv_sec = wake / 1000000000;
+            cond_time.tv_nsec = wake % 1000000000;
+            while (shard->current_alarm == deadline) {
+                shard->waiting = 1;
+                if (virtual)
+                    status = pthread_cond_wait (&shard->cond, &shard->mutex);
+                else
+                    status = pthread_cond_timedwait (
+                        &shard->cond, &shard->mutex, &cond_time);
+                shard->waiting = 0;
+                __atomic_store_n (&shard->wakeups, shard->wakeups + 1, __ATOMIC_RELAXED);
+                if (status == ETIMEDOUT)
+                    break;
+                if (status != 0)
+                    err_abort (status, "Cond timedwait");
+            }
+            continue;
+        }
+        ref = *head;
+        alarm = ALARM(ref);
+        alarm_latency_record (shard, class, now - alarm_deadline (ref, offset)
+            - (int64_t)ALARM_COLD(ref)->slack * 1000000000);
+        __atomic_store_n (&shard->fired, shard->fired + 1, __ATOMIC_RELAXED);
+        owner = ALARM_COLD(ref)->owner;
+        if (alarm_notify == NULL || owner == 0)
+            printf ("(%d) %s\n", alarm->seconds, MSG_TEXT(alarm->message));
+        else {
+            len = snprintf (text, sizeof (text), "(%d) %s\n",
+                alarm->seconds, MSG_TEXT(alarm->message));
+            alarm_notify (owner, text, len);
+        }
+        if (alarm->count > 0)
+            alarm->count--;
+        if (alarm->count == 0) {
+            __atomic_store_n (head, alarm->link, __ATOMIC_SEQ_CST); /* see retire */
+            alarm_retire (shard, ref);
+            continue;
+        }
+        /*
+         * A periodic alarm is requeued in place, one period after
+         * the deadline it just met. If the alarm thread has fallen
+         * more than a period behind, the missed firings follow
+         * immediately.
+         */
+        __atomic_add_fetch (&shard->moves, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n (head, alarm->link, __ATOMIC_RELEASE);
+        __atomic_store_n (&alarm->time, alarm->time + alarm->seconds,
+            __ATOMIC_RELAXED);
+        alarm_insert (shard, ref);
+    }
+}
+
+/*
+ * The alarm thread's start routine. There is one alarm thread per
+ * shard, passed as "arg". The clock it runs on and whether it spins
+ * are settled before the alarm threads start, so the thread runs the
+ * loop specialized for them; those left out by the policies in
+ * alarm.h are not compiled.
+ */
+void *alarm_group_display_creation (void *arg)
+{
+    alarm_shard_t *shard = (alarm_shard_t*)arg;
+
+    if (alarm_virtual)
+        alarm_thread_loop (shard, 1, 0);
+    else if (ALARM_SPIN && alarm_spin_ns > 0)
+        alarm_thread_loop (shard, 0, 1);
+    else
+        alarm_thread_loop (shard, 0, 0);
+    return NULL;
+}
+
+/*
+ * Run the scheduler on a virtual clock from now on, starting at
+ * "start" seconds since the Epoch (or at the real time, if 0). Must
+ * be called before the alarm threads start. Since the clock does
+ * not move by itself, spinning is turned off.
+ *
+ * The virtual clock belongs to this process: a process attached to
+ * a shared store still reads the real clocks. In a build without
+ * ALARM_VIRTUAL_CLOCK, the program exits instead.
+ */
+void alarm_clock_virtual (time_t start)
+{
+#if ALARM_VIRTUAL_CLOCK
+    virtual_now = alarm_now_ns (0);
+    virtual_offset = start != 0
+        ? (int64_t)start * 1000000000 - virtual_now
+        : alarm_now_ns (1) - virtual_now;
+    alarm_spin_ns = 0;
+    __atomic_store_n (&alarm_virtual, 1, __ATOMIC_RELEASE);
+#else
+    fprintf (stderr, "Built without the virtual clock (ALARM_VIRTUAL_CLOCK)\n");
+    exit (1);
+#endif
+}
+
+/*
+ * Move the virtual clock to "now" (ns on its CLOCK_MONOTONIC), and
+ * have every alarm thread look at its alarms again.
+ */
+void alarm_clock_advance (int64_t now)
+{
+    int i;
+
+    __atomic_store_n (&virtual_now, now, __ATOMIC_RELEASE);
+    for (i = 0; i < alarm_shard_count; i++)
+        alarm_kick (&alarm_shards[i]);
+}
+
+/*
+ * Wait until every alarm thread has fired the alarms that are due
+ * on the virtual clock and is waiting for the clock to move; return
+ * the earliest deadline they wait for, or 0 if they are all idle.
+ * An alarm thread fires with its mutex held, so once it is seen
+ * waiting, with nothing due, everything due has been written out.
+ */
+static int64_t alarm_clock_settle (void)
+{
+    alarm_shard_t *shard;
+    int64_t next = 0, now = alarm_now_ns (0);
+    int status, settled;
+
+    for (shard = alarm_shards; shard < alarm_shards + alarm_shard_count; shard++) {
+        do {
+            status = pthread_mutex_lock (&shard->mutex);
+            if (status != 0) err_abort (status, "Lock mutex");
+            settled = shard->waiting
+                && (alarm_shard_idle (shard) || shard->current_alarm > now);
+            if (settled && !alarm_shard_idle (shard)
+                && (next == 0 || shard->current_alarm < next))
+                next = shard->current_alarm;
+            status = pthread_mutex_unlock (&shard->mutex);
+            if (status != 0) err_abort (status, "Unlock mutex");
+            if (!settled)
+                sched_yield ();
+        } while (!settled);
+    }
+    return next;
+}
+
+/*
+ * Run the virtual clock forward to "until" (ns on its
+ * CLOCK_MONOTONIC), stopping at each deadline on the way, so that
+ * every alarm fires at its own (virtual) time and in order, however
+ * far apart they are. Returns once all alarms due by "until" have
+ * fired, or, with an "until" of 0, once no alarms are left (which a
+ * periodic alarm without a count never allows).
+ */
+void alarm_clock_run (int64_t until)
+{
+    int64_t next;
+
+    while ((next = alarm_clock_settle ()) != 0 && (until == 0 || next <= until))
+        alarm_clock_advance (next);
+    if (until > alarm_now_ns (0)) {
+        alarm_clock_advance (until);
+        alarm_clock_settle ();
+    }
+}
+
+/*
+ * The clock thread's start routine. It sleeps until someone sets
+ * CLOCK_REALTIME, which a timerfd armed with TFD_TIMER_CANCEL_ON_SET
+ * reports by failing its read with ECANCELED, and then wakes the
+ * alarm thread of every shard with wall-clock alarms, so that it
+ * works out their deadlines again; one that is now due fires at
+ * once. Alarms set for some seconds from now are not affected.
+ *
+ * On the virtual clock, which setting CLOCK_REALTIME does not move,
+ * there is nothing to watch, and the thread returns at once.
+ */
+void *alarm_clock_watch (void *arg)
+{
+    struct itimerspec timer;
+    struct timespec now;
+    uint64_t expired;
+    alarm_shard_t *shard;
+    int fd;
+
+    if (alarm_virtual)
+        return NULL;
+    fd = timerfd_create (CLOCK_REALTIME, TFD_CLOEXEC);
+    if (fd < 0) errno_abort ("Create timerfd");
+    memset (&timer, 0, sizeof (timer));
+    while (1) {
+        /*
+         * The timer has to be armed for the cancellation to be
+         * reported: arm it for a year from now. The timer runs on
+         * the real CLOCK_REALTIME, whatever clock the alarms use.
+         */
+        clock_gettime (CLOCK_REALTIME, &now);
+        timer.it_value.tv_sec = now.tv_sec + 365 * 24 * 60 * 60;
+        if (timerfd_settime (fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                &timer, NULL) < 0)
+            errno_abort ("Arm timerfd");
+        if (read (fd, &expired, sizeof (expired)) >= 0)
+            continue;
+        if (errno == EINTR)
+            continue;
+        if (errno != ECANCELED)
+            errno_abort ("Read timerfd");
+        for (shard = alarm_shards; shard < alarm_shards + alarm_shard_count; shard++) {
+            if (__atomic_load_n (&shard->list[ALARM_WALL], __ATOMIC_ACQUIRE) != 0)
+                alarm_kick (shard);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Find the link that points to a pending alarm, in its list.
+ *
+ * While walking the list, also find where an alarm due at "time"
+ * would go (before the first alarm due no earlier), in case the
+ * alarm is to be moved there: "*place" is the link to insert it at,
+ * or is set to NULL if that is after the alarm.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the shard's
+ * mutex!
+ */
+static alarm_ref_t *alarm_find (alarm_shard_t *shard, alarm_ref_t ref,
+    time_t time, alarm_ref_t **place)
+{
+    alarm_ref_t *last, next;
+
+    last = *place = alarm_list (shard, ref);
+    while ((next = *last) != ref) {
+        if (ALARM(next)->time < time)
+            *place = &ALARM(next)->link;
+        last = &ALARM(next)->link;
+    }
+    if (ALARM(ref)->time < time)
+        *place = NULL;
+    return last;
+}
+
+/*
+ * The shard whose slice of the alarm pool holds an alarm.
+ */
+static alarm_shard_t *alarm_ref_shard (alarm_ref_t ref)
+{
+    return &alarm_shards[(ref - 1) / (alarm_shards[0].pool_end - 1)];
+}
+
+/*
+ * Move a pending alarm to its place for a new deadline, in a single
+ * walk of its list: from where alarm_find found it, forward, if the
+ * deadline is later; otherwise to the place alarm_find saw on the
+ * way. No alarm is allocated or freed.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the shard's
+ * mutex!
+ */
+static void alarm_move (alarm_shard_t *shard, alarm_ref_t ref,
+    time_t time, alarm_ref_t *last, alarm_ref_t *place)
+{
+    alarm_t *alarm = ALARM(ref);
+    alarm_ref_t next;
+
+    if (place == NULL) {
+        for (place = &alarm->link; (next = *place) != 0;
+             place = &ALARM(next)->link)
+            if (ALARM(next)->time >= time)
+                break;
+    }
+    if (place == last || place == &alarm->link) {
+        /* stays where it is */
+        __atomic_store_n (&alarm->time, time, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch (&shard->moves, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n (last, alarm->link, __ATOMIC_RELEASE);
+        __atomic_store_n (&alarm->time, time, __ATOMIC_RELAXED);
+        __atomic_store_n (&alarm->link, *place, __ATOMIC_RELEASE);
+        __atomic_store_n (place, ref, __ATOMIC_RELEASE);
+    }
+    alarm_wake (shard, alarm_deadline (ref,
+        ALARM_COLD(ref)->wall ? alarm_wall_offset () : 0));
+}
+
+/*
+ * Change a pending alarm to belong to group "id_group", to be due
+ * "seconds" from now (and, if periodic, every "seconds" after that)
+ * and to carry "message". An alarm set for a time of day stays on
+ * the wall clock.
+ *
+ * The alarm is updated where it is: a new message is interned and
+ * the old one retired, leaving the list alone, and a new deadline
+ * moves the alarm within its list (see alarm_move). Only a change to
+ * a group of another shard has to take the alarm out of its shard
+ * and put a copy into the other.
+ *
+ * The alarm is found through the id index (alarm_id_lookup), and
+ * its shard from its place in the alarm pool. Since the alarm may
+ * fire or move between the lookup and locking its shard, the lookup
+ * is repeated under the lock, and must still find the same handle.
+ *
+ * Returns the alarm's new deadline, in seconds since the Epoch (as
+ * alarm_epoch gives it), or -1 with the reason (for the reply to
+ * the command) in "reason" if there is no such alarm, the new group
+ * will not take it (see alarm_admit) or there is no room for a new
+ * message.
+ */
+time_t alarm_change (int id_alarm, int id_group, int seconds,
+    const char *message, char *reason, size_t size)
+{
+    alarm_shard_t *shard, *target = ALARM_SHARD(id_group), *first, *second;
+    alarm_ref_t ref, copy, *last, *place;
+    alarm_handle_t handle;
+    alarm_t *alarm;
+    time_t time_new, due = -1;
+    msg_ref_t old, text = 0;
+    int status;
+
+    while (1) {
+        handle = alarm_id_lookup (id_alarm);
+        if (!alarm_handle_valid (handle)) {
+            if (handle != 0)
+                continue;       /* fired since: look again */
+            snprintf (reason, size, "no such alarm");
+            return -1;
+        }
+        ref = ALARM_HANDLE_REF(handle);
+        shard = alarm_ref_shard (ref);
+        /*
+         * Shard mutexes are taken in shard order, so that a change
+         * that needs two of them cannot deadlock with another.
+         */
+        first = shard < target ? shard : target;
+        second = shard < target ? target : shard;
+        status = pthread_mutex_lock (&first->mutex);
+        if (status != 0) err_abort (status, "Lock mutex");
+        if (second != first) {
+            status = pthread_mutex_lock (&second->mutex);
+            if (status != 0) err_abort (status, "Lock mutex");
+        }
+        if (alarm_id_lookup (id_alarm) == handle)
+            break;
+        if (second != first)
+            pthread_mutex_unlock (&second->mutex);
+        pthread_mutex_unlock (&first->mutex);
+    }
+    alarm = ALARM(ref);
+    time_new = alarm_clock (ALARM_COLD(ref)->wall) + seconds;
+    last = alarm_find (shard, ref, time_new, &place);
+    status = 0;
+    if (id_group != alarm->id_group
+        && alarm_admit (target, id_group, reason, size) < 0)
+        status = -1;
+    else if (target != shard
+        || strncmp (MSG_TEXT(alarm->message), message, MSG_MAX) != 0) {
+        text = msg_intern (target->msg, message);
+        if (text == 0) {
+            if (id_group != alarm->id_group)
+                alarm_release (target, id_group);
+            snprintf (reason, size, "alarm store full");
+            status = -1;
+        }
+    }
+    if (status < 0)
+        ;
+    else if (target != shard) {
+        copy = alarm_alloc (target);
+        *ALARM(copy) = *alarm;
+        ALARM_COLD(copy)->owner = ALARM_COLD(ref)->owner;
+        ALARM_COLD(copy)->slack = ALARM_COLD(ref)->slack;
+        ALARM_COLD(copy)->priority = ALARM_COLD(ref)->priority;
+        ALARM_COLD(copy)->wall = ALARM_COLD(ref)->wall;
+        ALARM(copy)->id_group = id_group;
+        ALARM(copy)->seconds = seconds;
+        ALARM(copy)->time = time_new;
+        ALARM(copy)->message = text;
+        alarm_id_update (id_alarm, ALARM_HANDLE(copy));
+        __atomic_add_fetch (&shard->moves, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n (last, alarm->link, __ATOMIC_SEQ_CST); /* see retire */
+        alarm_retire (shard, ref);
+        alarm_insert (target, copy);
+        due = alarm_epoch (copy);
+    } else {
+        if (id_group != alarm->id_group) {
+            alarm_release (shard, alarm->id_group);
+            __atomic_store_n (&alarm->id_group, id_group, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n (&alarm->seconds, seconds, __ATOMIC_RELAXED);
+        if (text != 0) {
+            old = alarm->message;
+            __atomic_store_n (&alarm->message, text, __ATOMIC_SEQ_CST); /* see retire */
+            retire (shard, 0, old);
+        }
+        if (time_new != alarm->time)
+            alarm_move (shard, ref, time_new, last, place);
+        due = alarm_epoch (ref);
+    }
+    if (second != first)
+        pthread_mutex_unlock (&second->mutex);
+    pthread_mutex_unlock (&first->mutex);
+    return status < 0 ? -1 : due;
+}
+
+/*
+ * Cancelling, suspending and reactivating an alarm are not
+ * implemented yet. Until they are, each fails, with "no such alarm"
+ * in "reason" if the alarm is not pending and "not implemented" if
+ * it is, rather than leave the client believing the alarm was
+ * acted on.
+ */
+static int alarm_unimplemented (int id_alarm, char *reason, size_t size)
+{
+    snprintf (reason, size, "%s", alarm_handle_valid (alarm_id_lookup (id_alarm))
+        ? "not implemented" : "no such alarm");
+    return -1;
+}
+
+int alarm_cancel (int id_alarm, char *reason, size_t size)
+{
+    return alarm_unimplemented (id_alarm, reason, size);
+}
+
+int alarm_suspend (int id_alarm, char *reason, size_t size)
+{
+    return alarm_unimplemented (id_alarm, reason, size);
+}
+
+int alarm_reactivate (int id_alarm, char *reason, size_t size)
+{
+    return alarm_unimplemented (id_alarm, reason, size);
+}
+
+/*
+ * Order View_Alarms entries by time, keeping the walk order of
+ * alarms due at the same moment.
+ */
+static int view_compare (const void *a, const void *b)
+{
+    const view_entry_t *x = (const view_entry_t*)a;
+    const view_entry_t *y = (const view_entry_t*)b;
+
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return x->order - y->order;
+}
+
+/*
+ * Print the pending alarms that match the filter.
+ *
+ * The shard lists are walked without any mutex, inside an epoch
+ * read-side section (see epoch_enter), so neither the alarm
+ * threads nor the intake threads ever wait for a view. The matching
+ * alarms are copied into a private snapshot, which is sorted by
+ * time once every shard and class list has been walked; formatting and writing
+ * the output happens after that. Times are shown since the Epoch,
+ * whichever clock the alarm is on. The snapshot is written out
+ * VIEW_CHUNK entries at a time. A view of one group only walks the
+ * shard that holds it.
+ *
+ * If a periodic alarm was relinked while we walked a shard, its
+ * walk is repeated (up to VIEW_RETRIES times) so that no alarm is
+ * skipped. The fields that change while an alarm stays on its list
+ * (see alarm_change) are read, and written, atomically.
+ *
+ * From a read-only attachment an alarm may be freed and reused under
+ * the walk. The pool stays mapped, so the worst that can happen is
+ * a stale or mixed-up line, and messages are copied with a bound.
+ */
+void alarm_view (const view_filter_t *filter, alarm_sink_t sink, void *arg)
+{
+    char *out;
+    size_t out_len;
+    view_entry_t *snapshot = NULL;
+    alarm_shard_t *shard, *last;
+    alarm_t *next;
+    alarm_ref_t ref;
+    time_t now, low, high, offset, due;
+    unsigned long moves;
+    int slot, capacity = 0, count = 0, start, i, retries, class, id_group;
+
+    now = alarm_clock (1);
+    offset = alarm_epoch_offset ();
+    low = now + filter->from;
+    high = filter->to < 0 ? 0 : now + filter->to;
+    shard = alarm_shards;
+    last = alarm_shards + alarm_shard_count - 1;
+    if (filter->id_group != 0)
+        shard = last = ALARM_SHARD(filter->id_group);
+    slot = epoch_enter ();
+    for (; shard <= last; shard++) {
+        start = count;
+        retries = 0;
+again:
+        count = start;
+        moves = __atomic_load_n (&shard->moves, __ATOMIC_SEQ_CST);
+        for (class = 0; class <= ALARM_WALL; class++) {
+            for (ref = __atomic_load_n (&shard->list[class], __ATOMIC_ACQUIRE);
+                 ref != 0;
+                 ref = __atomic_load_n (&next->link, __ATOMIC_ACQUIRE)) {
+                next = ALARM(ref);
+                due = __atomic_load_n (&next->time, __ATOMIC_RELAXED);
+                if (class != ALARM_WALL)
+                    due += offset;
+                if (high != 0 && due > high)
+                    break;          /* list is sorted by time */
+                if (due < low)
+                    continue;
+                id_group = __atomic_load_n (&next->id_group, __ATOMIC_RELAXED);
+                if (filter->id_group != 0 && id_group != filter->id_group)
+                    continue;
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : VIEW_CHUNK;
+                    snapshot = (view_entry_t*)realloc (
+                        snapshot, capacity * sizeof (view_entry_t));
+                    if (snapshot == NULL) errno_abort ("Allocate snapshot");
+                }
+                snapshot[count].order = count;
+                snapshot[count].id_alarm = next->id_alarm;
+                snapshot[count].id_group = id_group;
+                snapshot[count].seconds =
+                    __atomic_load_n (&next->seconds, __ATOMIC_RELAXED);
+                snapshot[count].time = due;
+                memccpy (snapshot[count].message, MSG_TEXT(__atomic_load_n (
+                    &next->message, __ATOMIC_ACQUIRE)), '\0', MSG_MAX);
+                snapshot[count].message[MSG_MAX] = '\0';
+                count++;
+            }
+        }
+        if (__atomic_load_n (&shard->moves, __ATOMIC_SEQ_CST) != moves
+            && ++retries < VIEW_RETRIES)
+            goto again;
+    }
+    epoch_exit (slot);
+    if (count > 1)
+        qsort (snapshot, count, sizeof (view_entry_t), view_compare);
+
+    out = (char*)malloc ((VIEW_CHUNK + 1) * VIEW_LINE_MAX);
+    if (out == NULL) errno_abort ("Allocate view output");
+    out_len = snprintf (out, VIEW_LINE_MAX,
+        "View Alarms at %ld: %d alarm(s)\n", now, count);
+    for (i = 0; i < count; i++) {
+        out_len += snprintf (out + out_len, VIEW_LINE_MAX,
+            "%d. Alarm(%d): Group(%d) %ld %d %s\n", i + 1,
+            snapshot[i].id_alarm, snapshot[i].id_group, snapshot[i].time,
+            snapshot[i].seconds, snapshot[i].message);
+        if ((i + 1) % VIEW_CHUNK == 0) {
+            sink (arg, out, out_len);
+            out_len = 0;
+        }
+    }
+    if (out_len > 0)
+        sink (arg, out, out_len);
+    free (out);
+    free (snapshot);
+}
+
+
+void *alarm_group_display_removal (void *arg) {
+    return NULL;
+}
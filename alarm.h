@@ -0,0 +1,428 @@
+/*
+ * alarm.h
+ *
+ * Shared declarations for the alarm scheduler: the alarm pool,
+ * the message arena, the sorted alarm list and the alarm thread,
+ * the command language and the socket server. The command-line
+ * front end (alarm_cond.c) and the benchmark (alarm_bench.c) are
+ * both built on top of these.
+ */
+#ifndef __alarm_h
+#define __alarm_h
+
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include "errors.h"
+
+/*
+ * Alarms and messages are referred to by 32-bit handles rather
+ * than pointers: an alarm_ref_t is an index into alarm_pool and a
+ * msg_ref_t is a byte offset into msg_arena. Zero is never handed
+ * out, so it serves as the "none" value for both.
+ */
+typedef uint32_t alarm_ref_t;
+typedef uint32_t msg_ref_t;
+
+/*
+ * The "alarm" structure contains the time_t (in seconds) for each
+ * alarm, so that they can be sorted. Storing the requested number
+ * of seconds would not be enough, since the "alarm thread" cannot
+ * tell how long it has been on the list. An alarm set for some
+ * seconds from now counts them on CLOCK_MONOTONIC, so that setting
+ * the system clock does not make it early or late; an alarm set for
+ * a time of day ("at", see alarm_parse) keeps its time since the
+ * Epoch, and follows the clock (see alarm_clock_watch).
+ *
+ * Only the fields that the list walk and the alarm thread look at
+ * live here, so that an alarm fills half a cache line. The message
+ * text is kept in the message arena and only touched when the alarm
+ * fires or is viewed.
+ *
+ * A one-shot alarm has a count of 1. A periodic alarm fires every
+ * "seconds" seconds until its count runs out; each deadline is
+ * computed from the previous deadline, not from the time it
+ * actually fired, so the period does not drift.
+ */
+typedef struct alarm_tag {
+    time_t              time;   /* on its clock, see alarm_clock */
+    alarm_ref_t         link;
+    int                 id_alarm;
+    int                 id_group;
+    int                 seconds;
+    msg_ref_t           message;
+    int                 count;  /* firings left, ALARM_FOREVER if no limit */
+} alarm_t;
+
+_Static_assert (sizeof (alarm_t) == 32, "alarm_t must stay 32 bytes");
+
+/*
+ * Per-alarm data that is only needed once an alarm fires lives in
+ * a parallel array indexed by the same alarm_ref_t, so that it
+ * does not take up room in the alarm_t nodes the list walk reads.
+ */
+typedef struct alarm_cold_tag {
+    uint32_t            owner;  /* channel notified on expiry, 0 = stdout */
+    int32_t             slack;  /* seconds it may fire late, to coalesce */
+    int16_t             priority; /* class, 0 to ALARM_CLASSES - 1 */
+    uint16_t            wall;   /* "time" is since the Epoch */
+    uint32_t            generation; /* times the entry was freed */
+} alarm_cold_t;
+
+#define ALARM_POOL_MAX  (1u << 24)      /* alarms that can exist at once */
+#define ALARM(ref)      (&alarm_pool[ref])
+#define ALARM_COLD(ref) (&alarm_cold[ref])
+#define ALARM_FOREVER   (-1)
+
+/*
+ * A handle names one lifetime of a pool entry: its alarm_ref_t and
+ * its generation, which alarm_free bumps, so that a handle kept past
+ * the end of its alarm is seen to be stale rather than reaching the
+ * alarm that reuses the entry. Checking one takes no lock. Zero is
+ * never a handle.
+ */
+typedef uint64_t alarm_handle_t;
+
+#define ALARM_HANDLE(ref) \
+    (((alarm_handle_t)ALARM_COLD(ref)->generation << 32) | (ref))
+#define ALARM_HANDLE_REF(handle) ((alarm_ref_t)(handle))
+
+/*
+ * alarm_init flags. The first two only apply to a preallocated
+ * arena (a nonzero capacity).
+ */
+#define ALARM_ARENA_HUGE 0x1            /* back it with huge pages */
+#define ALARM_ARENA_LOCK 0x2            /* and lock it into memory */
+#define ALARM_ARENA_NUMA 0x4            /* each shard's part on its node */
+
+#define ALARM_SHARDS_MAX 64             /* independent schedulers */
+#define ALARM_LATENCY_BUCKETS 24        /* <1us, then powers of 2 in us */
+#define ALARM_CLASSES   3               /* priority classes, 0 = normal */
+#define ALARM_WALL      ALARM_CLASSES   /* list of the wall-clock alarms */
+
+#define MSG_MAX         128             /* longest message, in bytes */
+#define MSG_ARENA_MAX   (1u << 30)      /* bytes reserved for messages */
+
+/*
+ * Compile-time policies of the scheduler core, each 0 or 1:
+ *
+ *      ALARM_TRACE             print each alarm list after an insert
+ *                              and each wait of an alarm thread (on by
+ *                              default with -DDEBUG)
+ *      ALARM_VIRTUAL_CLOCK     the virtual clock (alarm_clock_virtual);
+ *                              without it, reading the time does not
+ *                              test for it
+ *      ALARM_SPIN              spinning before deadlines (alarm_spin_ns)
+ *
+ * A policy that is off costs nothing: its code is compiled out. The
+ * alarm thread's loop is also specialized for each configuration an
+ * alarm thread can start in (see alarm_group_display_creation).
+ */
+#ifndef ALARM_TRACE
+# ifdef DEBUG
+#  define ALARM_TRACE           1
+# else
+#  define ALARM_TRACE           0
+# endif
+#endif
+#ifndef ALARM_VIRTUAL_CLOCK
+# define ALARM_VIRTUAL_CLOCK    1
+#endif
+#ifndef ALARM_SPIN
+# define ALARM_SPIN             1
+#endif
+
+/*
+ * The scheduler is split into shards, each a complete alarm list
+ * with its own mutex, condition variable and alarm thread. An
+ * alarm belongs to the shard of its group (ALARM_SHARD), so that
+ * commands for different groups, arriving on different intake
+ * threads, never contend for a lock. Each shard also owns a slice
+ * of the alarm pool and a heap of the message arena, so that
+ * allocation needs nothing but the shard's own mutex.
+ *
+ * Alarms come in ALARM_CLASSES priority classes, and each class has
+ * its own list. When alarms of several classes are due at once, the
+ * alarm thread fires those of the highest class first, so a flood of
+ * ordinary alarms cannot hold up an urgent one behind it. Alarms
+ * set for a time of day, whatever their class, are kept on one more
+ * list of their own (ALARM_WALL), since their times are on another
+ * clock.
+ *
+ * The "mutex" protects everything in the shard except "list" and
+ * the links of the alarms on it, which lock-free readers may walk
+ * (see alarm.c).
+ */
+typedef struct msg_heap_tag msg_heap_t;
+typedef struct admit_table_tag admit_table_t;
+struct retired_tag;
+
+typedef struct alarm_shard_tag {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    alarm_ref_t         list[ALARM_CLASSES + 1]; /* each sorted by time */
+    int64_t             current_alarm;  /* alarm thread waits for this (ns) */
+    unsigned long       moves;          /* live alarms relinked */
+    alarm_ref_t         pool_top;       /* next never-used entry */
+    alarm_ref_t         pool_end;       /* end of the shard's slice */
+    alarm_ref_t         pool_free;
+    struct retired_tag  *retired;
+    int                 retired_count;
+    int                 retired_size;
+    msg_heap_t          *msg;
+    admit_table_t       *admit;         /* groups, see alarm_admit.c */
+    pthread_t           thread;
+    int                 waiting;        /* alarm thread is in a cond wait */
+    uint64_t            latency[ALARM_CLASSES][ALARM_LATENCY_BUCKETS]; /* see alarm_latency */
+    uint64_t            wakeups;        /* alarm thread woke up */
+    uint64_t            fired;          /* alarms it fired */
+} __attribute__ ((aligned (64))) alarm_shard_t;
+
+#define ALARM_SHARD(id_group) \
+    (&alarm_shards[(unsigned)(id_group) % alarm_shard_count])
+
+/*
+ * Whether a shard has no pending alarms in any class.
+ */
+static inline int alarm_shard_idle (alarm_shard_t *shard)
+{
+    int class;
+
+    for (class = 0; class <= ALARM_WALL; class++)
+        if (__atomic_load_n (&shard->list[class], __ATOMIC_ACQUIRE) != 0)
+            return 0;
+    return 1;
+}
+
+/*
+ * View_Alarms filter. A zero id_group matches every group; the
+ * time window is given in seconds relative to the moment the view
+ * is taken, and a negative "to" leaves the window open-ended.
+ */
+typedef struct view_filter_tag {
+    int                 id_group;
+    int                 from;
+    int                 to;
+} view_filter_t;
+
+/*
+ * A parsed (or decoded) command. "action" is the code returned by
+ * input_validator.
+ */
+typedef struct alarm_args_tag {
+    int                 action;
+    int                 id_alarm;
+    int                 id_group;
+    int                 seconds;
+    int                 count;
+    int                 slack;
+    int                 priority;
+    time_t              at;             /* due at this Epoch time, or 0 */
+    view_filter_t       filter;
+    char                message[MSG_MAX + 1];
+} alarm_args_t;
+
+/*
+ * The binary form of a command, for clients that would rather not
+ * format and parse text: this fixed header, in host byte order
+ * (the socket is local), followed by "length" bytes of message
+ * text (or, for View_Alarms, of filter words). "opcode" is the
+ * input_validator code of the command; "tag" is echoed in the
+ * reply frames. Replies come back as ALARM_FRAME_DATA frames
+ * carrying the reply text, then an ALARM_FRAME_OK or
+ * ALARM_FRAME_ERR frame. No text line starts with
+ * ALARM_FRAME_MAGIC, so both forms can share a connection.
+ */
+#define ALARM_FRAME_MAGIC       0xA1
+#define ALARM_FRAME_DATA        0x80
+#define ALARM_FRAME_OK          0x81
+#define ALARM_FRAME_ERR         0x82
+#define ALARM_FRAME_PAYLOAD_MAX 256
+
+typedef struct alarm_frame_tag {
+    uint8_t             magic;
+    uint8_t             opcode;
+    uint16_t            length;
+    uint32_t            tag;
+    int32_t             id_alarm;
+    int32_t             id_group;
+    int32_t             seconds;
+    int32_t             count;
+    int32_t             slack;
+    int32_t             priority;
+    int64_t             at;             /* see alarm_args_t */
+} alarm_frame_t;
+
+_Static_assert (sizeof (alarm_frame_t) == 40, "alarm_frame_t is 40 bytes");
+
+/*
+ * Where a kind of thread runs: thread "index" is pinned to
+ * cpus[index % cpu_count] (or left wherever the system puts it if
+ * cpu_count is 0), and, with a nonzero "priority", runs under
+ * SCHED_FIFO at that priority. See thread_create.
+ */
+#define THREAD_CPUS_MAX 1024
+
+typedef struct thread_place_tag {
+    int                 cpu_count;
+    int                 priority;
+    int                 cpus[THREAD_CPUS_MAX];
+} thread_place_t;
+
+/*
+ * Admission limits (see alarm_admit.c); 0 is no limit. They are set
+ * before the alarm store is; a process attached to a shared store
+ * uses those of the store's owner.
+ */
+typedef struct alarm_limits_tag {
+    uint32_t            total;          /* pending alarms */
+    uint32_t            group;          /* pending alarms per group */
+    uint32_t            rate;           /* new alarms/s per group */
+    uint32_t            burst;          /* at once, within "rate" (0: rate) */
+} alarm_limits_t;
+
+/*
+ * Where command replies go. Each input channel supplies its own.
+ *
+ * A sink is called once with a NULL "text" when the reply to a new
+ * alarm is complete, before the alarm can fire: a sink that
+ * acknowledges requests (tagged lines and binary frames) writes the
+ * acknowledgement there, so that it goes out ahead of the alarm's
+ * expiry message. Other sinks ignore it.
+ */
+typedef void (*alarm_sink_t) (void *arg, const char *text, size_t len);
+
+extern alarm_t *alarm_pool;
+extern alarm_cold_t *alarm_cold;
+extern alarm_shard_t *alarm_shards;
+extern int alarm_shard_count;
+extern sem_t *sem_start_alarm;
+extern sem_t *sem_display_threads;
+extern int alarm_readonly;
+extern int64_t alarm_spin_ns;
+#if ALARM_VIRTUAL_CLOCK
+extern int alarm_virtual;
+#else
+# define alarm_virtual          0
+#endif
+extern void (*alarm_notify) (uint32_t owner, const char *text, size_t len);
+extern thread_place_t alarm_place;      /* the alarm threads */
+extern thread_place_t intake_place;     /* the socket intake threads */
+extern alarm_limits_t alarm_limits;
+
+/*
+ * Whether a handle still names a live pool entry (see alarm_handle_t).
+ */
+static inline int alarm_handle_valid (alarm_handle_t handle)
+{
+    return handle != 0 && __atomic_load_n (
+        &ALARM_COLD(ALARM_HANDLE_REF(handle))->generation, __ATOMIC_ACQUIRE)
+        == (uint32_t)(handle >> 32);
+}
+
+/*
+ * alarm.c
+ */
+extern void alarm_init (int shards, uint32_t capacity, int flags);
+extern int alarm_share (const char *name, int shards, uint32_t capacity,
+    int flags);
+extern int alarm_attach (const char *name, int readonly);
+extern alarm_ref_t alarm_alloc (alarm_shard_t *shard);
+extern void alarm_free (alarm_shard_t *shard, alarm_ref_t ref);
+extern void alarm_insert (alarm_shard_t *shard, alarm_ref_t ref);
+extern void alarm_retire (alarm_shard_t *shard, alarm_ref_t ref);
+extern int thread_place_parse (thread_place_t *place, const char *list);
+extern int alarm_numa_node (int shard);
+extern void alarm_numa_bind (void *start, size_t size, int node);
+extern int alarm_numa_place (thread_place_t *place, int threads);
+extern int thread_create (pthread_t *thread, const thread_place_t *place,
+    int index, void *(*start) (void *), void *arg);
+extern void thread_place_self (const thread_place_t *place, int index);
+extern int64_t alarm_now_ns (int wall);
+extern time_t alarm_clock (int wall);
+extern void alarm_clock_virtual (time_t start);
+extern void alarm_clock_advance (int64_t now);
+extern void alarm_clock_run (int64_t until);
+extern time_t alarm_epoch (alarm_ref_t ref);
+extern void *alarm_clock_watch (void *arg);
+extern int epoch_enter (void);
+extern void epoch_exit (int slot);
+extern void epoch_reclaim (alarm_shard_t *shard);
+extern void *alarm_group_display_creation (void *arg);
+extern void *alarm_group_display_removal (void *arg);
+extern time_t alarm_change (int id_alarm, int id_group, int seconds,
+    const char *message, char *reason, size_t size);
+extern int alarm_cancel (int id_alarm, char *reason, size_t size);
+extern int alarm_suspend (int id_alarm, char *reason, size_t size);
+extern int alarm_reactivate (int id_alarm, char *reason, size_t size);
+extern void alarm_latency (int priority,
+    uint64_t histogram[ALARM_LATENCY_BUCKETS]);
+extern void alarm_wakeups (uint64_t *wakeups, uint64_t *fired);
+extern void alarm_view (const view_filter_t *filter,
+    alarm_sink_t sink, void *arg);
+
+/*
+ * alarm_admit.c
+ */
+extern size_t admit_space (int shards, uint32_t capacity);
+extern void admit_init (char *space, int shards, uint32_t capacity,
+    int attach);
+extern admit_table_t *admit_table (int index);
+extern int alarm_admit (alarm_shard_t *shard, int id_group, char *reason,
+    size_t size);
+extern void alarm_release (alarm_shard_t *shard, int id_group);
+extern uint32_t alarm_admitted (void);
+
+/*
+ * alarm_ids.c
+ */
+extern size_t ids_space (int parts, uint32_t capacity);
+extern void ids_init (char *space, int parts, uint32_t capacity, int attach,
+    int shared);
+extern int alarm_id_insert (int id_alarm, alarm_handle_t handle,
+    char *reason, size_t size);
+extern void alarm_id_update (int id_alarm, alarm_handle_t handle);
+extern void alarm_id_remove (int id_alarm, alarm_handle_t handle);
+extern alarm_handle_t alarm_id_lookup (int id_alarm);
+
+/*
+ * alarm_command.c
+ */
+extern void view_filter_parse (const char *args, view_filter_t *filter);
+extern int input_validator (const char *keyword_action,
+    const char *keyword_group, int user_arg);
+extern int alarm_parse (const char *line, alarm_args_t *args);
+extern int alarm_args_check (const alarm_args_t *args);
+extern int alarm_execute (const alarm_args_t *args, uint32_t owner,
+    alarm_sink_t sink, void *arg);
+extern int alarm_frame_decode (const alarm_frame_t *frame,
+    const char *payload, alarm_args_t *args);
+extern int alarm_frame_request (const alarm_frame_t *frame,
+    const char *payload, uint32_t owner, alarm_sink_t sink, void *arg);
+extern int alarm_command (const char *line, uint32_t owner,
+    alarm_sink_t sink, void *arg);
+extern int alarm_request (const char *line, uint32_t owner,
+    alarm_sink_t sink, void *arg);
+
+/*
+ * alarm_server.c
+ */
+extern int alarm_server (const char *path, int threads);
+
+/*
+ * alarm_msg.c
+ */
+extern char *msg_arena;
+extern size_t msg_space (int heaps, uint32_t messages);
+extern void msg_init (char *space, int heaps, uint32_t messages,
+    int attach);
+extern msg_heap_t *msg_heap (int index);
+extern void msg_bind (int index, int node);
+extern msg_ref_t msg_intern (msg_heap_t *heap, const char *text);
+extern void msg_release (msg_heap_t *heap, msg_ref_t ref);
+extern size_t msg_arena_used (void);
+
+#define MSG_TEXT(ref)   (msg_arena + (ref))
+
+#endif
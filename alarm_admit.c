@@ -0,0 +1,283 @@
+/*
+ * alarm_admit.c
+ *
+ * Admission control. Before a new alarm is allocated, alarm_admit
+ * decides whether to take it, against limits set in alarm_limits:
+ *
+ *      total   pending alarms in all shards
+ *      group   pending alarms in any one group
+ *      rate    new alarms per second in any one group, in bursts of
+ *              up to "burst" (if 0, up to "rate")
+ *
+ * so that a runaway producer gets its commands refused, with a
+ * reason, instead of growing the alarm store until it is full and
+ * slowing down every other group's alarms. A zero limit is no limit.
+ * The store filling up is always refused the same way rather than
+ * aborting the process.
+ *
+ * Each shard keeps a table of the groups it holds, with their
+ * pending alarm count and rate state. The rate limit is a token
+ * bucket kept as a single time per group, the moment the bucket
+ * will next be full ("theoretical arrival time"): each alarm moves
+ * it one interval on, and an alarm is refused if that would put it
+ * more than a burst ahead of now.
+ *
+ * Groups are never deleted one by one. When the table is 70% used,
+ * it is rebuilt without the groups that have no pending alarms and
+ * a full bucket. In a preallocated (or shared) alarm store the
+ * tables live in the store, with a fixed size and a spare to
+ * rebuild into, like the intern tables of the message arena.
+ *
+ * The limits live in the store too, next to the global count: the
+ * process that creates a shared store copies its alarm_limits there,
+ * and processes attached to it admit alarms against those, since
+ * the counts they guard are the owner's.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * alarm_admit and alarm_release require that the caller have locked
+ * the mutex of the shard that owns the group!
+ */
+#include "alarm.h"
+
+typedef struct admit_entry_tag {
+    int32_t             id_group;       /* 0 if empty */
+    uint32_t            live;           /* pending alarms */
+    int64_t             full;           /* bucket full again, in ns */
+} admit_entry_t;
+
+struct admit_table_tag {
+    admit_entry_t       *entries;
+    admit_entry_t       *spare;         /* NULL if the table can grow */
+    uint32_t            size;           /* a power of 2 */
+    uint32_t            used;           /* entries ever filled */
+};
+
+/*
+ * What a store's admission tables share: the global count and the
+ * limits it is checked against.
+ */
+typedef struct admit_shared_tag {
+    uint32_t            live;           /* pending in all shards */
+    alarm_limits_t      limits;         /* those of the store's owner */
+} admit_shared_t;
+
+alarm_limits_t alarm_limits;
+
+static admit_table_t *admit_tables = NULL;
+static uint32_t admit_live_local;
+static uint32_t *admit_live = &admit_live_local; /* pending in all shards */
+static alarm_limits_t *admit_limits = &alarm_limits; /* in force */
+
+#define ADMIT_ALIGN(size)       (((size) + 63) & ~(size_t)63)
+
+/*
+ * Layout of the admission tables of a preallocated store for
+ * "capacity" alarms: the global count and the limits (admit_shared_t),
+ * the table headers, then two
+ * tables per shard, each big enough for every alarm of the shard to
+ * be in a group of its own.
+ */
+static uint32_t admit_table_entries (int shards, uint32_t capacity)
+{
+    uint32_t entries = 64;
+
+    while (entries < ((size_t)capacity / shards + 1) * 10 / 7 + 1)
+        entries *= 2;
+    return entries;
+}
+
+size_t admit_space (int shards, uint32_t capacity)
+{
+    return ADMIT_ALIGN(sizeof (admit_shared_t))
+        + ADMIT_ALIGN(shards * sizeof (admit_table_t))
+        + (size_t)shards * 2
+            * admit_table_entries (shards, capacity) * sizeof (admit_entry_t);
+}
+
+/*
+ * Set up the admission tables of "shards" shards, at "space" for a
+ * preallocated store (see admit_space) or, with a NULL "space", as
+ * tables that grow as needed. With "attach", the store was set up
+ * by another process and only our pointers into it are; otherwise
+ * alarm_limits, as set by now, are copied into it.
+ */
+void admit_init (char *space, int shards, uint32_t capacity, int attach)
+{
+    uint32_t entries;
+    admit_entry_t *tables;
+    admit_shared_t *shared;
+    int i;
+
+    if (space == NULL) {
+        admit_tables = (admit_table_t*)calloc (shards, sizeof (admit_table_t));
+        if (admit_tables == NULL) errno_abort ("Allocate admission tables");
+        for (i = 0; i < shards; i++) {
+            admit_tables[i].size = 64;
+            admit_tables[i].entries = (admit_entry_t*)calloc (
+                64, sizeof (admit_entry_t));
+            if (admit_tables[i].entries == NULL)
+                errno_abort ("Allocate admission table");
+        }
+        return;
+    }
+    entries = admit_table_entries (shards, capacity);
+    shared = (admit_shared_t*)space;
+    admit_live = &shared->live;
+    admit_limits = &shared->limits;
+    space += ADMIT_ALIGN(sizeof (admit_shared_t));
+    admit_tables = (admit_table_t*)space;
+    space += ADMIT_ALIGN(shards * sizeof (admit_table_t));
+    tables = (admit_entry_t*)space;
+    if (attach)
+        return;
+    shared->limits = alarm_limits;
+    for (i = 0; i < shards; i++) {
+        admit_tables[i].entries = tables + (size_t)i * 2 * entries;
+        admit_tables[i].spare = admit_tables[i].entries + entries;
+        admit_tables[i].size = entries;
+    }
+}
+
+admit_table_t *admit_table (int index)
+{
+    return &admit_tables[index];
+}
+
+/*
+ * Rebuild a table without its idle groups, into its spare or, if
+ * it can grow, into a new table twice the size of what is left.
+ * Returns -1 if a fixed table is still too full afterwards.
+ */
+static int admit_table_rebuild (admit_table_t *table, int64_t now)
+{
+    admit_entry_t *old = table->entries;
+    uint32_t old_size = table->size;
+    uint32_t i, j, kept = 0;
+
+    for (i = 0; i < old_size; i++)
+        if (old[i].id_group != 0 && (old[i].live > 0 || old[i].full > now))
+            kept++;
+    if (table->spare != NULL) {
+        if ((kept + 1) * 10 > table->size * 7)
+            return -1;
+        table->entries = table->spare;
+        table->spare = old;
+        memset (table->entries, 0, table->size * sizeof (admit_entry_t));
+    } else {
+        table->size = 64;
+        while (table->size < (kept + 1) * 2)
+            table->size *= 2;
+        table->entries = (admit_entry_t*)calloc (table->size, sizeof (admit_entry_t));
+        if (table->entries == NULL) errno_abort ("Allocate admission table");
+    }
+    table->used = kept;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].id_group == 0 || (old[i].live == 0 && old[i].full <= now))
+            continue;
+        j = ((uint32_t)old[i].id_group * 2654435769u) & (table->size - 1);
+        while (table->entries[j].id_group != 0)
+            j = (j + 1) & (table->size - 1);
+        table->entries[j] = old[i];
+    }
+    if (table->spare == NULL)
+        free (old);
+    return 0;
+}
+
+/*
+ * Find the entry of a group, adding it if "create" is set. Returns
+ * NULL if the group is not there, or cannot be added.
+ */
+static admit_entry_t *admit_find (admit_table_t *table, int id_group,
+    int create, int64_t now)
+{
+    uint32_t i;
+
+    if (create && (table->used + 1) * 10 > table->size * 7
+        && admit_table_rebuild (table, now) < 0)
+        return NULL;
+    for (i = ((uint32_t)id_group * 2654435769u) & (table->size - 1);
+         table->entries[i].id_group != 0;
+         i = (i + 1) & (table->size - 1))
+        if (table->entries[i].id_group == id_group)
+            return &table->entries[i];
+    if (!create)
+        return NULL;
+    table->entries[i].id_group = id_group;
+    table->used++;
+    return &table->entries[i];
+}
+
+/*
+ * Decide whether the shard may take one more alarm of group
+ * "id_group", and count it in if so. Returns 0, or -1 with the
+ * reason (for the reply to the command) written to "reason".
+ */
+int alarm_admit (alarm_shard_t *shard, int id_group, char *reason,
+    size_t size)
+{
+    admit_entry_t *group;
+    int64_t now = alarm_now_ns (0), interval = 0, start, ahead;
+    uint32_t live, burst;
+
+    if (shard->pool_free == 0 && shard->pool_top == shard->pool_end) {
+        snprintf (reason, size, "alarm store full");
+        return -1;
+    }
+    group = admit_find (shard->admit, id_group, 1, now);
+    if (group == NULL) {
+        snprintf (reason, size, "too many groups");
+        return -1;
+    }
+    if (admit_limits->group != 0 && group->live >= admit_limits->group) {
+        snprintf (reason, size, "Group(%d) has %u alarms pending",
+            id_group, group->live);
+        return -1;
+    }
+    if (admit_limits->rate != 0) {
+        burst = admit_limits->burst != 0 ? admit_limits->burst : admit_limits->rate;
+        interval = 1000000000 / admit_limits->rate;
+        start = group->full > now ? group->full : now;
+        ahead = (int64_t)(burst - 1) * interval;
+        if (start - now > ahead) {
+            snprintf (reason, size, "Group(%d) over %u alarms/s, retry in %ld ms",
+                id_group, admit_limits->rate,
+                (long)((start - now - ahead + 999999) / 1000000));
+            return -1;
+        }
+    }
+    live = __atomic_add_fetch (admit_live, 1, __ATOMIC_RELAXED);
+    if (admit_limits->total != 0 && live > admit_limits->total) {
+        __atomic_sub_fetch (admit_live, 1, __ATOMIC_RELAXED);
+        snprintf (reason, size, "%u alarms pending", admit_limits->total);
+        return -1;
+    }
+    if (interval != 0)
+        group->full = (group->full > now ? group->full : now) + interval;
+    group->live++;
+    return 0;
+}
+
+/*
+ * Count out an alarm of group "id_group" that is no longer pending.
+ * Alarms that never went through alarm_admit are not counted.
+ */
+void alarm_release (alarm_shard_t *shard, int id_group)
+{
+    admit_entry_t *group;
+
+    group = admit_find (shard->admit, id_group, 0, 0);
+    if (group == NULL || group->live == 0)
+        return;
+    group->live--;
+    __atomic_sub_fetch (admit_live, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Alarms pending in all shards, as counted by alarm_admit.
+ */
+uint32_t alarm_admitted (void)
+{
+    return __atomic_load_n (admit_live, __ATOMIC_RELAXED);
+}
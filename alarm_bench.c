@@ -0,0 +1,1066 @@
+/*
+ * alarm_bench.c
+ *
+ * Micro-benchmarks for the alarm scheduler. Each benchmark is
+ * selected by name on the command line:
+ *
+ *      alarm_bench layout [alarms]
+ *      alarm_bench memory [alarms] [distinct messages]
+ *      alarm_bench socket path [connections] [commands]
+ *      alarm_bench pipeline path [commands]
+ *      alarm_bench wire [commands] [path]
+ *      alarm_bench arena [alarms]
+ *      alarm_bench latency [firings] [spin usec]
+ *      alarm_bench coalesce [alarms] [seconds] [slack]
+ *      alarm_bench priority [alarms]
+ *      alarm_bench virtual [alarms] [hours] [shards]
+ *
+ * "layout" compares the original alarm_t (link, ids and a 128-byte
+ * message in one 160-byte node) with the current one (a 32-byte
+ * node from the alarm pool plus the text in the message arena). It
+ * inserts the same alarms into a sorted list with each layout, then
+ * expires them all, and reports time and cache misses per alarm.
+ *
+ * "memory" creates alarms whose messages are drawn from a given
+ * number of distinct texts and compares the bytes per alarm of the
+ * original layout with the pool (the alarm_t nodes and their
+ * alarm_cold_t entries) plus interned message arena.
+ *
+ * "socket" drives a running "alarm_cond -s path" server: it opens
+ * the given number of connections, has every one of them send its
+ * Start_Alarm commands as fast as the server takes them, and waits
+ * for all replies. Every alarm is due at once, so each command
+ * costs a parse, an insert at the head of a short list, the insert
+ * reply, and the expiry message delivered back on the connection.
+ *
+ * "pipeline" sends tagged Start_Alarm commands over a single
+ * connection, keeping 1, 8, 64 and then 512 requests outstanding,
+ * checks that every request is acknowledged, in order, and reports
+ * the commands per second reached at each depth.
+ *
+ * "wire" compares the text command language with binary frames:
+ * first the cost of turning one Start_Alarm into alarm_args_t each
+ * way (alarm_parse against alarm_frame_decode), then, given the path
+ * of a running server, the commands per second reached over one
+ * connection with 64 requests outstanding, as tagged text and as
+ * frames.
+ *
+ * "arena" creates a burst of alarms, first in the default pool
+ * (reserved address space, backed on first touch), then in a
+ * preallocated arena, and then in one on huge pages, locked. Each
+ * runs in a child process of its own, since alarm_init sets up the
+ * scheduler once per process; minor page faults per alarm are
+ * reported beside the time.
+ *
+ * "latency" runs the alarm thread on a periodic alarm that fires
+ * every second, once sleeping until each deadline and once spinning
+ * for the last microseconds before it (see alarm_spin), and shows
+ * the histograms of how late the alarm fired. Each run takes
+ * "firings" seconds, in a child process of its own.
+ *
+ * "coalesce" spreads alarms evenly over the given number of
+ * seconds and lets them all fire, once with no slack and once with
+ * every alarm allowing "slack" seconds (see alarm_coalesce), and
+ * reports how many times the alarm thread woke up to fire them.
+ * Each run is again a child process.
+ *
+ * "priority" makes a flood of ordinary alarms and a handful of
+ * alarms of the highest class due in the same second, and shows the
+ * firing latency histogram of each class: the urgent alarms go out
+ * first, however many others are due.
+ *
+ * "virtual" spreads alarms at random over the given number of
+ * hours, in groups over the given number of shards, and fires them
+ * all on the virtual clock (see alarm_clock_run). Each alarm carries
+ * its deadline as its message, so the run checks that every one
+ * fires exactly then and that no firing goes back in time, and
+ * reports how long the whole schedule took in real time.
+ *
+ * Cache misses are read from the hardware counters through
+ * perf_event_open; where that is not permitted they are reported as
+ * "n/a" and only times are shown.
+ */
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "alarm.h"
+
+/*
+ * The alarm structure as it was before the hot/cold split.
+ */
+typedef struct legacy_alarm_tag {
+    struct legacy_alarm_tag *link;
+    int                 seconds;
+    int                 id_alarm;
+    int                 id_group;
+    char                message[128];
+    time_t              time;
+} legacy_alarm_t;
+
+/*
+ * A pair of hardware counters: all cache misses (last level) and
+ * L1 data cache read misses.
+ */
+typedef struct counters_tag {
+    int                 fd[2];
+    long long           value[2];
+    double              ns;
+    struct timespec     start;
+} counters_t;
+
+static volatile size_t sink;    /* defeats dead code elimination */
+
+/*
+ * The alarm_sink_t for the replies to bench_start: dropped.
+ */
+static void bench_reply (void *arg, const char *text, size_t len)
+{
+    sink += len;
+}
+
+/*
+ * Start an alarm the way a Start_Alarm command does (or, with a
+ * "count" other than 1, a Periodic_Alarm), through alarm_execute:
+ * admission control, the id index and the reply all take part, as
+ * they do for real commands. The benchmark fails if it is refused.
+ */
+static void bench_start (uint32_t owner, int id_alarm, int id_group,
+    int seconds, int count, int slack, int priority, const char *message)
+{
+    alarm_args_t args;
+
+    memset (&args, 0, sizeof (args));
+    args.action = count == 1 ? 3 : 7;
+    args.id_alarm = id_alarm;
+    args.id_group = id_group;
+    args.seconds = seconds;
+    args.count = count;
+    args.slack = slack;
+    args.priority = priority;
+    snprintf (args.message, sizeof (args.message), "%s", message);
+    if (alarm_execute (&args, owner, bench_reply, NULL) <= 0) {
+        fprintf (stderr, "Alarm(%d) not started\n", id_alarm);
+        exit (1);
+    }
+}
+
+static int perf_open (uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.size = sizeof (attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counters_init (counters_t *c)
+{
+    c->fd[0] = perf_open (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    c->fd[1] = perf_open (PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+}
+
+static void counters_start (counters_t *c)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+        if (c->fd[i] >= 0) {
+            ioctl (c->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl (c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    clock_gettime (CLOCK_MONOTONIC, &c->start);
+}
+
+static void counters_stop (counters_t *c)
+{
+    struct timespec end;
+    int i;
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    c->ns = (end.tv_sec - c->start.tv_sec) * 1e9
+        + (end.tv_nsec - c->start.tv_nsec);
+    for (i = 0; i < 2; i++) {
+        c->value[i] = -1;
+        if (c->fd[i] >= 0) {
+            ioctl (c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read (c->fd[i], &c->value[i], sizeof (c->value[i]))
+                != sizeof (c->value[i]))
+                c->value[i] = -1;
+        }
+    }
+}
+
+static void counters_report (const char *label, counters_t *c, int ops)
+{
+    char miss[2][32];
+    int i;
+
+    for (i = 0; i < 2; i++)
+        if (c->value[i] < 0)
+            strcpy (miss[i], "n/a");
+        else
+            snprintf (miss[i], sizeof (miss[i]), "%.2f",
+                (double)c->value[i] / ops);
+    printf ("%-16s %10.1f %14s %14s\n", label, c->ns / ops, miss[0], miss[1]);
+}
+
+/*
+ * Sorted insert and expiry with the original node layout.
+ */
+static void layout_legacy (counters_t *c, const time_t *times, int count)
+{
+    legacy_alarm_t **nodes, *list = NULL, **last, *next, *alarm;
+    int i;
+
+    nodes = (legacy_alarm_t**)malloc (count * sizeof (*nodes));
+    if (nodes == NULL) errno_abort ("Allocate nodes");
+    for (i = 0; i < count; i++) {
+        nodes[i] = (legacy_alarm_t*)malloc (sizeof (legacy_alarm_t));
+        if (nodes[i] == NULL) errno_abort ("Allocate alarm");
+        nodes[i]->id_alarm = i + 1;
+        nodes[i]->id_group = i % 16 + 1;
+        nodes[i]->seconds = (int)times[i];
+        nodes[i]->time = times[i];
+        snprintf (nodes[i]->message, sizeof (nodes[i]->message),
+            "Group %d heartbeat %d", nodes[i]->id_group, i);
+    }
+
+    counters_start (c);
+    for (i = 0; i < count; i++) {
+        alarm = nodes[i];
+        last = &list;
+        next = *last;
+        while (next != NULL && next->time < alarm->time) {
+            last = &next->link;
+            next = next->link;
+        }
+        alarm->link = next;
+        *last = alarm;
+    }
+    counters_stop (c);
+    counters_report ("legacy insert", c, count);
+
+    counters_start (c);
+    while (list != NULL) {
+        alarm = list;
+        list = alarm->link;
+        sink += strlen (alarm->message) + alarm->seconds;
+        free (alarm);
+    }
+    counters_stop (c);
+    counters_report ("legacy expire", c, count);
+    free (nodes);
+}
+
+/*
+ * The same work with the pool and message arena, through the
+ * scheduler's own alarm_insert.
+ */
+static void layout_split (counters_t *c, const time_t *times, int count)
+{
+    alarm_shard_t *shard = &alarm_shards[0];
+    alarm_ref_t *refs, ref;
+    alarm_t *alarm;
+    char message[MSG_MAX + 1];
+    int i;
+
+    refs = (alarm_ref_t*)malloc (count * sizeof (*refs));
+    if (refs == NULL) errno_abort ("Allocate refs");
+    pthread_mutex_lock (&shard->mutex);
+    for (i = 0; i < count; i++) {
+        refs[i] = alarm_alloc (shard);
+        alarm = ALARM(refs[i]);
+        alarm->id_alarm = i + 1;
+        alarm->id_group = i % 16 + 1;
+        alarm->seconds = (int)times[i];
+        alarm->count = 1;
+        alarm->time = times[i];
+        snprintf (message, sizeof (message),
+            "Group %d heartbeat %d", alarm->id_group, i);
+        alarm->message = msg_intern (shard->msg, message);
+    }
+
+    counters_start (c);
+    for (i = 0; i < count; i++)
+        alarm_insert (shard, refs[i]);
+    counters_stop (c);
+    counters_report ("split insert", c, count);
+
+    counters_start (c);
+    while (shard->list[0] != 0) {
+        ref = shard->list[0];
+        alarm = ALARM(ref);
+        shard->list[0] = alarm->link;
+        sink += strlen (MSG_TEXT(alarm->message)) + alarm->seconds;
+        msg_release (shard->msg, alarm->message);
+        alarm_free (shard, ref);
+    }
+    counters_stop (c);
+    counters_report ("split expire", c, count);
+    pthread_mutex_unlock (&shard->mutex);
+    free (refs);
+}
+
+static int bench_layout (int argc, char *argv[])
+{
+    counters_t counters;
+    time_t *times;
+    int count = argc > 0 ? atoi (argv[0]) : 20000;
+    int i;
+
+    if (count < 1) {
+        fprintf (stderr, "Bad alarm count\n");
+        return 1;
+    }
+    times = (time_t*)malloc (count * sizeof (time_t));
+    if (times == NULL) errno_abort ("Allocate times");
+    srand (1);
+    for (i = 0; i < count; i++)
+        times[i] = 1000000 + rand () % 86400;
+
+    alarm_init (1, 0, 0);
+    counters_init (&counters);
+    printf ("%d alarms, alarm_t %zu bytes (was %zu)\n",
+        count, sizeof (alarm_t), sizeof (legacy_alarm_t));
+    printf ("%-16s %10s %14s %14s\n",
+        "per alarm", "ns", "cache-misses", "L1d-misses");
+    layout_legacy (&counters, times, count);
+    layout_split (&counters, times, count);
+    free (times);
+    return 0;
+}
+
+static int bench_memory (int argc, char *argv[])
+{
+    alarm_shard_t *shard;
+    counters_t counters;
+    alarm_ref_t ref;
+    alarm_t *alarm;
+    char message[MSG_MAX + 1];
+    int count = argc > 0 ? atoi (argv[0]) : 1000000;
+    int distinct = argc > 1 ? atoi (argv[1]) : 1000;
+    size_t before, after;
+    int i;
+
+    if (count < 1 || distinct < 1) {
+        fprintf (stderr, "Bad alarm or message count\n");
+        return 1;
+    }
+    alarm_init (1, 0, 0);
+    shard = &alarm_shards[0];
+    counters_init (&counters);
+    pthread_mutex_lock (&shard->mutex);
+    counters_start (&counters);
+    for (i = 0; i < count; i++) {
+        ref = alarm_alloc (shard);
+        alarm = ALARM(ref);
+        alarm->id_alarm = i + 1;
+        alarm->id_group = i % distinct + 1;
+        alarm->seconds = 60;
+        alarm->count = 1;
+        alarm->time = 1000000 + i;
+        snprintf (message, sizeof (message),
+            "Group %d heartbeat", alarm->id_group);
+        alarm->message = msg_intern (shard->msg, message);
+    }
+    counters_stop (&counters);
+    before = count * sizeof (legacy_alarm_t);
+    after = count * (sizeof (alarm_t) + sizeof (alarm_cold_t))
+        + msg_arena_used ();
+    printf ("%d alarms, %d distinct messages\n", count, distinct);
+    printf ("legacy layout   %10zu bytes  %6.1f bytes/alarm\n",
+        before, (double)before / count);
+    printf ("interned        %10zu bytes  %6.1f bytes/alarm\n",
+        after, (double)after / count);
+    printf ("%-16s %10s %14s %14s\n",
+        "per alarm", "ns", "cache-misses", "L1d-misses");
+    counters_report ("intern", &counters, count);
+    pthread_mutex_unlock (&shard->mutex);
+    return 0;
+}
+
+/*
+ * One benchmark connection: the commands still to send and the
+ * number of reply lines still expected.
+ */
+typedef struct bench_conn_tag {
+    int                 fd;
+    char                *out;
+    size_t              out_len;
+    size_t              sent;
+    int                 replies;
+} bench_conn_t;
+
+static int bench_socket (int argc, char *argv[])
+{
+    struct sockaddr_un address;
+    struct epoll_event event, events[256];
+    struct rlimit limit;
+    struct timespec start, end;
+    bench_conn_t *conns, *conn;
+    char buffer[65536];
+    int connections, commands, ep, i, j, ready, pending;
+    ssize_t got;
+    size_t len;
+    double seconds;
+
+    if (argc < 1) {
+        fprintf (stderr, "Missing socket path\n");
+        return 1;
+    }
+    connections = argc > 1 ? atoi (argv[1]) : 1000;
+    commands = argc > 2 ? atoi (argv[2]) : 100;
+    if (connections < 1 || commands < 1) {
+        fprintf (stderr, "Bad connection or command count\n");
+        return 1;
+    }
+    if (getrlimit (RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit (RLIMIT_NOFILE, &limit);
+    }
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strncpy (address.sun_path, argv[0], sizeof (address.sun_path) - 1);
+    conns = (bench_conn_t*)calloc (connections, sizeof (bench_conn_t));
+    if (conns == NULL) errno_abort ("Allocate connections");
+    ep = epoll_create1 (0);
+    if (ep < 0) errno_abort ("Create epoll");
+
+    for (i = 0; i < connections; i++) {
+        conn = &conns[i];
+        conn->fd = socket (AF_UNIX, SOCK_STREAM, 0);
+        if (conn->fd < 0) errno_abort ("Create socket");
+        if (connect (conn->fd, (struct sockaddr*)&address,
+                sizeof (address)) < 0)
+            errno_abort ("Connect");
+        fcntl (conn->fd, F_SETFL, fcntl (conn->fd, F_GETFL) | O_NONBLOCK);
+        conn->out = (char*)malloc ((size_t)commands * 64);
+        if (conn->out == NULL) errno_abort ("Allocate commands");
+        for (j = 0; j < commands; j++)
+            conn->out_len += sprintf (conn->out + conn->out_len,
+                "Start_Alarm(%d): Group(%d) 0 bench\n",
+                i * commands + j + 1, i % 64 + 1);
+        conn->replies = 2 * commands;      /* inserted, then expired */
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.u32 = i;
+        if (epoll_ctl (ep, EPOLL_CTL_ADD, conn->fd, &event) < 0)
+            errno_abort ("Add connection");
+    }
+
+    pending = connections;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    while (pending > 0) {
+        ready = epoll_wait (ep, events, 256, -1);
+        if (ready < 0) errno_abort ("Wait for events");
+        for (i = 0; i < ready; i++) {
+            conn = &conns[events[i].data.u32];
+            if ((events[i].events & EPOLLOUT) && conn->sent < conn->out_len) {
+                got = write (conn->fd, conn->out + conn->sent,
+                    conn->out_len - conn->sent);
+                if (got > 0)
+                    conn->sent += got;
+                if (conn->sent == conn->out_len) {
+                    event.events = EPOLLIN;
+                    event.data.u32 = events[i].data.u32;
+                    epoll_ctl (ep, EPOLL_CTL_MOD, conn->fd, &event);
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP)) {
+                while ((got = read (conn->fd, buffer, sizeof (buffer))) > 0)
+                    for (len = 0; len < (size_t)got; len++)
+                        if (buffer[len] == '\n' && --conn->replies == 0)
+                            pending--;
+                if (got == 0 && conn->replies > 0) {
+                    fprintf (stderr, "Server closed a connection\n");
+                    return 1;
+                }
+            }
+        }
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf ("%d connections x %d commands: %.3f s, %.0f commands/s\n",
+        connections, commands, seconds,
+        (double)connections * commands / seconds);
+    for (i = 0; i < connections; i++) {
+        close (conns[i].fd);
+        free (conns[i].out);
+    }
+    free (conns);
+    return 0;
+}
+
+/*
+ * Run "commands" tagged requests with up to "depth" outstanding.
+ * Returns the number of acknowledgements that arrived out of order
+ * or were not OK.
+ */
+static int pipeline_run (int fd, int commands, int depth, int *next_id,
+    double *seconds)
+{
+    struct timespec start, end;
+    char buffer[65536], command[96], word[16], *line, *newline;
+    size_t len = 0;
+    ssize_t got;
+    int sent = 0, acked = 0, bad = 0, tag, n, first = *next_id;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    while (acked < commands) {
+        while (sent < commands && sent - acked < depth) {
+            n = sprintf (command,
+                "#%d Start_Alarm(%d): Group(1) 0 pipeline\n",
+                first + sent, first + sent);
+            if (write (fd, command, n) != n) errno_abort ("Send command");
+            sent++;
+        }
+        got = read (fd, buffer + len, sizeof (buffer) - len - 1);
+        if (got <= 0) errno_abort ("Read replies");
+        len += got;
+        buffer[len] = '\0';
+        line = buffer;
+        while ((newline = strchr (line, '\n')) != NULL) {
+            *newline = '\0';
+            if (sscanf (line, "#%d %15s", &tag, word) == 2
+                && (strcmp (word, "OK") == 0 || strcmp (word, "ERR") == 0)) {
+                if (tag != first + acked || strcmp (word, "OK") != 0)
+                    bad++;
+                acked++;
+            }
+            line = newline + 1;
+        }
+        len -= line - buffer;
+        memmove (buffer, line, len);
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    *next_id += commands;
+    return bad;
+}
+
+static int bench_pipeline (int argc, char *argv[])
+{
+    static const int depths[] = { 1, 8, 64, 512 };
+    struct sockaddr_un address;
+    int fd, commands, i, bad, next_id = 1;
+    double seconds;
+
+    if (argc < 1) {
+        fprintf (stderr, "Missing socket path\n");
+        return 1;
+    }
+    commands = argc > 1 ? atoi (argv[1]) : 20000;
+    if (commands < 1) {
+        fprintf (stderr, "Bad command count\n");
+        return 1;
+    }
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strncpy (address.sun_path, argv[0], sizeof (address.sun_path) - 1);
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) errno_abort ("Create socket");
+    if (connect (fd, (struct sockaddr*)&address, sizeof (address)) < 0)
+        errno_abort ("Connect");
+    printf ("%8s %12s %10s\n", "depth", "commands/s", "bad acks");
+    for (i = 0; i < (int)(sizeof (depths) / sizeof (depths[0])); i++) {
+        bad = pipeline_run (fd, commands, depths[i], &next_id, &seconds);
+        printf ("%8d %12.0f %10d\n", depths[i], commands / seconds, bad);
+    }
+    close (fd);
+    return 0;
+}
+
+/*
+ * Run "commands" Start_Alarm requests over "fd", as tagged text or
+ * as binary frames, with up to "depth" outstanding. Returns the
+ * number of acknowledgements that arrived out of order or were not
+ * OK.
+ */
+static int wire_run (int fd, int commands, int depth, int binary,
+    int *next_id, double *seconds)
+{
+    struct timespec start, end;
+    alarm_frame_t frame;
+    char buffer[65536], command[96], word[16], *next, *newline;
+    size_t len = 0, size;
+    ssize_t got;
+    int sent = 0, acked = 0, bad = 0, tag, n, first = *next_id;
+
+    memset (&frame, 0, sizeof (frame));
+    frame.magic = ALARM_FRAME_MAGIC;
+    frame.opcode = 3;
+    frame.id_group = 1;
+    frame.length = 4;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    while (acked < commands) {
+        while (sent < commands && sent - acked < depth) {
+            if (binary) {
+                frame.tag = frame.id_alarm = first + sent;
+                memcpy (command, &frame, sizeof (frame));
+                memcpy (command + sizeof (frame), "wire", 4);
+                n = sizeof (frame) + 4;
+            } else
+                n = sprintf (command, "#%d Start_Alarm(%d): Group(1) 0 wire\n",
+                    first + sent, first + sent);
+            if (write (fd, command, n) != n) errno_abort ("Send command");
+            sent++;
+        }
+        got = read (fd, buffer + len, sizeof (buffer) - len - 1);
+        if (got <= 0) errno_abort ("Read replies");
+        len += got;
+        buffer[len] = '\0';
+        next = buffer;
+        while (next < buffer + len) {
+            if ((unsigned char)*next == ALARM_FRAME_MAGIC) {
+                if (buffer + len - next < (ptrdiff_t)sizeof (frame))
+                    break;
+                memcpy (&frame, next, sizeof (frame));
+                size = sizeof (frame) + frame.length;
+                if ((size_t)(buffer + len - next) < size)
+                    break;
+                if (frame.opcode == ALARM_FRAME_OK || frame.opcode == ALARM_FRAME_ERR) {
+                    if (frame.tag != (uint32_t)(first + acked) || frame.opcode != ALARM_FRAME_OK)
+                        bad++;
+                    acked++;
+                }
+                next += size;
+                continue;
+            }
+            if ((newline = memchr (next, '\n', buffer + len - next)) == NULL)
+                break;
+            *newline = '\0';
+            if (sscanf (next, "#%d %15s", &tag, word) == 2
+                && (strcmp (word, "OK") == 0 || strcmp (word, "ERR") == 0)) {
+                if (tag != first + acked || strcmp (word, "OK") != 0)
+                    bad++;
+                acked++;
+            }
+            next = newline + 1;
+        }
+        len -= next - buffer;
+        memmove (buffer, next, len);
+        frame.magic = ALARM_FRAME_MAGIC;
+        frame.opcode = 3;
+        frame.id_group = 1;
+        frame.length = 4;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    *next_id += commands;
+    return bad;
+}
+
+static int bench_wire (int argc, char *argv[])
+{
+    struct sockaddr_un address;
+    alarm_frame_t *frames;
+    alarm_args_t args;
+    counters_t counters;
+    char (*lines)[64];
+    int fd, commands, i, bad, binary, next_id = 1;
+    double seconds;
+
+    commands = argc > 0 ? atoi (argv[0]) : 100000;
+    if (commands < 1) {
+        fprintf (stderr, "Bad command count\n");
+        return 1;
+    }
+    lines = malloc (commands * sizeof (*lines));
+    frames = malloc (commands * 2 * sizeof (alarm_frame_t));
+    if (lines == NULL || frames == NULL) errno_abort ("Allocate commands");
+    for (i = 0; i < commands; i++) {
+        snprintf (lines[i], sizeof (lines[i]),
+            "Start_Alarm(%d): Group(%d) %d Message %d\n",
+            i + 1, i % 100 + 1, i % 3600, i % 1000);
+        memset (&frames[i * 2], 0, sizeof (alarm_frame_t));
+        frames[i * 2].magic = ALARM_FRAME_MAGIC;
+        frames[i * 2].opcode = 3;
+        frames[i * 2].id_alarm = i + 1;
+        frames[i * 2].id_group = i % 100 + 1;
+        frames[i * 2].seconds = i % 3600;
+        frames[i * 2].length = snprintf ((char*)&frames[i * 2 + 1], 16,
+            "Message %d", i % 1000);
+    }
+    counters_init (&counters);
+    printf ("%-16s %10s %14s %14s\n", "decode", "ns/command", "LLC miss/cmd", "L1D miss/cmd");
+    counters_start (&counters);
+    for (i = 0; i < commands; i++)
+        sink += alarm_parse (lines[i], &args) + args.seconds;
+    counters_stop (&counters);
+    counters_report ("text", &counters, commands);
+    counters_start (&counters);
+    for (i = 0; i < commands; i++)
+        sink += alarm_frame_decode (&frames[i * 2],
+            (const char*)&frames[i * 2 + 1], &args) + args.seconds;
+    counters_stop (&counters);
+    counters_report ("binary", &counters, commands);
+    free (lines);
+    free (frames);
+    if (argc < 2)
+        return 0;
+
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strncpy (address.sun_path, argv[1], sizeof (address.sun_path) - 1);
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) errno_abort ("Create socket");
+    if (connect (fd, (struct sockaddr*)&address, sizeof (address)) < 0)
+        errno_abort ("Connect");
+    printf ("\n%-16s %12s %10s\n", "socket", "commands/s", "bad acks");
+    for (binary = 0; binary < 2; binary++) {
+        bad = wire_run (fd, commands, 64, binary, &next_id, &seconds);
+        printf ("%-16s %12.0f %10d\n", binary ? "binary" : "text",
+            commands / seconds, bad);
+    }
+    close (fd);
+    return 0;
+}
+
+/*
+ * One "arena" run, in a child process.
+ */
+static void arena_run (const char *label, int count, uint32_t capacity,
+    int flags)
+{
+    counters_t counters;
+    struct rusage before, after;
+    char message[MSG_MAX + 1];
+    int i;
+
+    alarm_init (1, capacity, flags);
+    counters_init (&counters);
+    getrusage (RUSAGE_SELF, &before);
+    counters_start (&counters);
+    for (i = 0; i < count; i++) {
+        snprintf (message, sizeof (message), "Burst alarm %d", i);
+        /* each goes to the head */
+        bench_start (0, i + 1, 1, 1000000 + count - i, 1, 0, 0, message);
+    }
+    counters_stop (&counters);
+    getrusage (RUSAGE_SELF, &after);
+    counters_report (label, &counters, count);
+    printf ("%-16s %10.3f minor faults/alarm\n", "",
+        (double)(after.ru_minflt - before.ru_minflt) / count);
+}
+
+static int bench_arena (int argc, char *argv[])
+{
+    static const struct {
+        const char *label;
+        int preallocate;
+        int flags;
+    } modes[] = {
+        { "reserved", 0, 0 },
+        { "preallocated", 1, 0 },
+        { "huge, locked", 1, ALARM_ARENA_HUGE | ALARM_ARENA_LOCK },
+    };
+    int count = argc > 0 ? atoi (argv[0]) : 1000000;
+    int i, status;
+    pid_t pid;
+
+    if (count < 1) {
+        fprintf (stderr, "Bad alarm count\n");
+        return 1;
+    }
+    printf ("%d alarms, each with its own message\n", count);
+    printf ("%-16s %10s %14s %14s\n",
+        "per alarm", "ns", "cache-misses", "L1d-misses");
+    for (i = 0; i < (int)(sizeof (modes) / sizeof (modes[0])); i++) {
+        fflush (stdout);
+        pid = fork ();
+        if (pid < 0) errno_abort ("Fork");
+        if (pid == 0) {
+            arena_run (modes[i].label, count,
+                modes[i].preallocate ? count : 0, modes[i].flags);
+            fflush (stdout);
+            _exit (0);
+        }
+        if (waitpid (pid, &status, 0) < 0) errno_abort ("Wait");
+    }
+    return 0;
+}
+
+/*
+ * The alarm_notify hook for "latency": expiry messages are dropped.
+ */
+static void latency_notify (uint32_t owner, const char *text, size_t len)
+{
+    sink += len;
+}
+
+/*
+ * Print a firing latency histogram (see alarm_latency).
+ */
+static void latency_print (uint64_t histogram[ALARM_LATENCY_BUCKETS])
+{
+    int i;
+
+    for (i = 0; i < ALARM_LATENCY_BUCKETS; i++) {
+        if (histogram[i] == 0)
+            continue;
+        if (i == 0)
+            printf ("  %10s %8s us %6lu\n", "", "< 1", (unsigned long)histogram[i]);
+        else
+            printf ("  %8ld - %8ld us %6lu\n", 1L << (i - 1), 1L << i,
+                (unsigned long)histogram[i]);
+    }
+}
+
+/*
+ * One "latency" run, in a child process.
+ */
+static void latency_run (int firings, int64_t spin_ns)
+{
+    alarm_shard_t *shard;
+    uint64_t histogram[ALARM_LATENCY_BUCKETS], total = 0;
+    int i, status;
+
+    alarm_init (1, 0, 0);
+    alarm_spin_ns = spin_ns;
+    alarm_notify = latency_notify;
+    shard = &alarm_shards[0];
+    status = pthread_create (&shard->thread, NULL,
+        alarm_group_display_creation, shard);
+    if (status != 0) err_abort (status, "Create alarm thread");
+    bench_start (1, 1, 1, 1, firings, 0, 0, "latency");
+    while (!alarm_shard_idle (shard))
+        sleep (1);
+
+    alarm_latency (-1, histogram);
+    for (i = 0; i < ALARM_LATENCY_BUCKETS; i++)
+        total += histogram[i];
+    printf ("spin %ld us: %lu firings\n", (long)(spin_ns / 1000),
+        (unsigned long)total);
+    latency_print (histogram);
+}
+
+static int bench_latency (int argc, char *argv[])
+{
+    int firings = argc > 0 ? atoi (argv[0]) : 10;
+    long spin_us = argc > 1 ? atol (argv[1]) : 200;
+    int i, status;
+    pid_t pid;
+
+    if (firings < 1 || spin_us < 1) {
+        fprintf (stderr, "Bad firing count or spin time\n");
+        return 1;
+    }
+    for (i = 0; i < 2; i++) {
+        fflush (stdout);
+        pid = fork ();
+        if (pid < 0) errno_abort ("Fork");
+        if (pid == 0) {
+            latency_run (firings, i == 0 ? 0 : spin_us * 1000);
+            fflush (stdout);
+            _exit (0);
+        }
+        if (waitpid (pid, &status, 0) < 0) errno_abort ("Wait");
+    }
+    return 0;
+}
+
+/*
+ * One "coalesce" run, in a child process. The alarms are all in
+ * the list before the alarm thread starts, so that every wakeup it
+ * counts is one it chose.
+ */
+static void coalesce_run (int count, int seconds, int slack)
+{
+    alarm_shard_t *shard;
+    uint64_t wakeups, fired;
+    struct timespec start, end;
+    int i, status;
+
+    alarm_init (1, count, 0);
+    alarm_notify = latency_notify;
+    shard = &alarm_shards[0];
+    for (i = 0; i < count; i++)
+        bench_start (1, i + 1, 1, 1 + i % seconds, 1, slack, 0, "coalesce");
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    status = pthread_create (&shard->thread, NULL,
+        alarm_group_display_creation, shard);
+    if (status != 0) err_abort (status, "Create alarm thread");
+    while (!alarm_shard_idle (shard))
+        usleep (100000);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    alarm_wakeups (&wakeups, &fired);
+    printf ("slack %2d s: %8lu alarms fired in %4lu wakeups, %.1f s\n",
+        slack, (unsigned long)fired, (unsigned long)wakeups,
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+static int bench_coalesce (int argc, char *argv[])
+{
+    int count = argc > 0 ? atoi (argv[0]) : 1000;
+    int seconds = argc > 1 ? atoi (argv[1]) : 8;
+    int slack = argc > 2 ? atoi (argv[2]) : 3;
+    int i, status;
+    pid_t pid;
+
+    if (count < 1 || seconds < 1 || slack < 0) {
+        fprintf (stderr, "Bad alarm count, seconds or slack\n");
+        return 1;
+    }
+    for (i = 0; i < 2; i++) {
+        fflush (stdout);
+        pid = fork ();
+        if (pid < 0) errno_abort ("Fork");
+        if (pid == 0) {
+            coalesce_run (count, seconds, i == 0 ? 0 : slack);
+            fflush (stdout);
+            _exit (0);
+        }
+        if (waitpid (pid, &status, 0) < 0) errno_abort ("Wait");
+    }
+    return 0;
+}
+
+/*
+ * "priority": a flood of class 0 alarms and a few class 2 alarms,
+ * all due in the same second, inserted class 0 first.
+ */
+static int bench_priority (int argc, char *argv[])
+{
+    int count = argc > 0 ? atoi (argv[0]) : 200000;
+    int urgent = 16;
+    alarm_shard_t *shard;
+    uint64_t histogram[ALARM_LATENCY_BUCKETS];
+    time_t due;
+    int i, class, status;
+
+    if (count < 1) {
+        fprintf (stderr, "Bad alarm count\n");
+        return 1;
+    }
+    alarm_init (1, count + urgent, 0);
+    alarm_notify = latency_notify;
+    shard = &alarm_shards[0];
+    due = alarm_clock (0) + 2;
+    for (i = 0; i < count + urgent; i++)
+        bench_start (1, i + 1, 1, due - alarm_clock (0), 1, 0,
+            i < count ? 0 : ALARM_CLASSES - 1, i < count ? "bulk" : "urgent");
+    status = pthread_create (&shard->thread, NULL,
+        alarm_group_display_creation, shard);
+    if (status != 0) err_abort (status, "Create alarm thread");
+    while (!alarm_shard_idle (shard))
+        usleep (10000);
+
+    for (class = ALARM_CLASSES - 1; class >= 0; class--) {
+        alarm_latency (class, histogram);
+        printf ("class %d:\n", class);
+        latency_print (histogram);
+    }
+    return 0;
+}
+
+/*
+ * The alarm_notify hook for "virtual": check the deadline in the
+ * message against the virtual clock.
+ */
+static uint64_t virtual_fired, virtual_late, virtual_back;
+static time_t virtual_last;
+
+static void virtual_notify (uint32_t owner, const char *text, size_t len)
+{
+    time_t now = alarm_clock (0), last;
+    long due;
+
+    __atomic_add_fetch (&virtual_fired, 1, __ATOMIC_RELAXED);
+    if (sscanf (text, "(%*d) %ld", &due) != 1 || due != now)
+        __atomic_add_fetch (&virtual_late, 1, __ATOMIC_RELAXED);
+    last = __atomic_exchange_n (&virtual_last, now, __ATOMIC_RELAXED);
+    if (last > now)
+        __atomic_add_fetch (&virtual_back, 1, __ATOMIC_RELAXED);
+}
+
+static int bench_virtual (int argc, char *argv[])
+{
+    int count = argc > 0 ? atoi (argv[0]) : 20000;
+    int hours = argc > 1 ? atoi (argv[1]) : 24;
+    int shards = argc > 2 ? atoi (argv[2]) : 4;
+    struct timespec start, end;
+    char message[32];
+    int i, seconds, status;
+
+    if (count < 1 || hours < 1 || shards < 1 || shards > ALARM_SHARDS_MAX) {
+        fprintf (stderr, "Bad alarm count, hours or shards\n");
+        return 1;
+    }
+    alarm_init (shards, 0, 0);
+    alarm_clock_virtual (0);
+    alarm_notify = virtual_notify;
+    srandom (1);
+    for (i = 0; i < count; i++) {
+        seconds = 1 + random () % (hours * 3600);
+        /* the virtual clock stands still until alarm_clock_run */
+        snprintf (message, sizeof (message), "%ld",
+            (long)(alarm_clock (0) + seconds));
+        bench_start (1, i + 1, 1 + random () % 1000, seconds, 1, 0, 0, message);
+    }
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (i = 0; i < shards; i++) {
+        status = pthread_create (&alarm_shards[i].thread, NULL,
+            alarm_group_display_creation, &alarm_shards[i]);
+        if (status != 0) err_abort (status, "Create alarm thread");
+    }
+    alarm_clock_run (0);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    printf ("%d hours, %d alarms on %d shards: %.2f s\n", hours, count, shards,
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    printf ("fired %lu, off their deadline %lu, out of order %lu\n",
+        (unsigned long)virtual_fired, (unsigned long)virtual_late,
+        (unsigned long)virtual_back);
+    return virtual_fired != (uint64_t)count || virtual_late != 0 || virtual_back != 0;
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp (argv[1], "layout") == 0)
+        return bench_layout (argc - 2, argv + 2);
+    if (argc >= 2 && strcmp (argv[1], "memory") == 0)
+        return bench_memory (argc - 2, argv + 2);
+    if (argc >= 2 && strcmp (argv[1], "socket") == 0)
+        return bench_socket (argc - 2, argv + 2);
+    if (argc >= 2 && strcmp (argv[1], "pipeline") == 0)
+        return bench_pipeline (argc - 2, argv + 2);
+    if (argc >= 2 && strcmp (argv[1], "wire") == 0)
+        return bench_wire (argc - 2, argv + 2);
+    if (argc >= 2 && strcmp (argv[1], "arena") == 0)
+        return bench_arena (argc - 2, argv + 2);
+    if (argc >= 2 && strcmp (argv[1], "latency") == 0)
+        return bench_latency (argc - 2, argv + 2);
+    if (argc >= 2 && strcmp (argv[1], "coalesce") == 0)
+        return bench_coalesce (argc - 2, argv + 2);
+    if (argc >= 2 && strcmp (argv[1], "priority") == 0)
+        return bench_priority (argc - 2, argv + 2);
+    if (argc >= 2 && strcmp (argv[1], "virtual") == 0)
+        return bench_virtual (argc - 2, argv + 2);
+    fprintf (stderr, "usage: %s layout [alarms]\n"
+        "       %s memory [alarms] [distinct messages]\n"
+        "       %s socket path [connections] [commands]\n"
+        "       %s pipeline path [commands]\n"
+        "       %s wire [commands] [path]\n"
+        "       %s arena [alarms]\n"
+        "       %s latency [firings] [spin usec]\n"
+        "       %s coalesce [alarms] [seconds] [slack]\n"
+        "       %s priority [alarms]\n"
+        "       %s virtual [alarms] [hours] [shards]\n",
+        argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+        argv[0], argv[0], argv[0]);
+    return 1;
+}
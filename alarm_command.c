@@ -0,0 +1,600 @@
+/*
+ * alarm_command.c
+ *
+ * The alarm command language, shared by every input channel (the
+ * "Alarm>" prompt and the socket server):
+ *
+ *      Start_Alarm(id): Group(g) seconds [Slack(s)] [Priority(p)] message
+ *      Start_Alarm(id): Group(g) at time [Slack(s)] [Priority(p)] message
+ *      Periodic_Alarm(id): Group(g) seconds [Count(n)] [Slack(s)]
+ *          [Priority(p)] message
+ *      Periodic_Alarm(id): Group(g) at time seconds [Count(n)] ...
+ *      Change_Alarm(id): Group(g) seconds message
+ *      Cancel_Alarm(id)
+ *      Suspend_Alarm(id)
+ *      Reactivate_Alarm(id)
+ *      View_Alarms [Group(g)] [From(s)] [To(s)]
+ *
+ * Replies are written through an alarm_sink_t, so that each
+ * channel can send them wherever the command came from.
+ *
+ * A command may be preceded by a request tag, so that a client can
+ * send many commands without waiting and still match up replies:
+ *
+ *      #17 Start_Alarm(1): Group(2) 30 Hello
+ *
+ * Every line of the reply to a tagged command then starts with the
+ * same tag, and the reply always ends with an acknowledgement line,
+ * "#17 OK" or "#17 ERR <reason>". Lines that do not start with a
+ * tag (such as expiry messages) are not replies to any request.
+ *
+ * Socket clients may also send commands as binary frames (see
+ * alarm_frame_t in alarm.h), which skip the text parsing entirely.
+ */
+#include <stddef.h>
+#include "alarm.h"
+
+#define TAG_MAX         24              /* longest request tag */
+#define TAG_BUFFER      4096
+
+/*
+ * An alarm_sink_t that puts the request tag in front of every
+ * line before passing it on, gathering the output into larger
+ * writes.
+ */
+typedef struct tag_sink_tag {
+    alarm_sink_t        sink;
+    void                *arg;
+    char                tag[TAG_MAX + 2];       /* "#tag " */
+    size_t              tag_len;
+    int                 line_start;
+    int                 acked;          /* OK already written */
+    size_t              len;
+    char                buffer[TAG_BUFFER];
+} tag_sink_t;
+
+static void tag_flush (tag_sink_t *tagged)
+{
+    if (tagged->len > 0)
+        tagged->sink (tagged->arg, tagged->buffer, tagged->len);
+    tagged->len = 0;
+}
+
+static void tag_put (tag_sink_t *tagged, const char *text, size_t len)
+{
+    if (tagged->len + len > TAG_BUFFER) {
+        tag_flush (tagged);
+        if (len > TAG_BUFFER) {
+            tagged->sink (tagged->arg, text, len);
+            return;
+        }
+    }
+    memcpy (tagged->buffer + tagged->len, text, len);
+    tagged->len += len;
+}
+
+static void tag_sink (void *arg, const char *text, size_t len)
+{
+    tag_sink_t *tagged = (tag_sink_t*)arg;
+    const char *end;
+    size_t part;
+
+    if (text == NULL) {
+        /* a new alarm's reply is complete: acknowledge it now */
+        if (!tagged->line_start)
+            tag_sink (tagged, "\n", 1);
+        tag_sink (tagged, "OK\n", 3);
+        tag_flush (tagged);
+        tagged->acked = 1;
+        return;
+    }
+    while (len > 0) {
+        if (tagged->line_start)
+            tag_put (tagged, tagged->tag, tagged->tag_len);
+        end = memchr (text, '\n', len);
+        part = end != NULL ? end - text + 1 : len;
+        tag_put (tagged, text, part);
+        tagged->line_start = end != NULL;
+        text += part;
+        len -= part;
+    }
+}
+
+/*
+ * An alarm_sink_t that wraps the reply text of a binary request in
+ * ALARM_FRAME_DATA frames, gathering the output into larger frames.
+ */
+typedef struct frame_sink_tag {
+    alarm_sink_t        sink;
+    void                *arg;
+    int                 acked;          /* ALARM_FRAME_OK already sent */
+    alarm_frame_t       header;
+    char                buffer[TAG_BUFFER];
+} frame_sink_t;
+
+_Static_assert (offsetof (frame_sink_t, buffer)
+    == offsetof (frame_sink_t, header) + sizeof (alarm_frame_t),
+    "frame payload follows its header");
+
+static void frame_flush (frame_sink_t *framed, uint8_t opcode)
+{
+    if (framed->header.length == 0 && opcode == ALARM_FRAME_DATA)
+        return;
+    framed->header.opcode = opcode;
+    framed->sink (framed->arg, (const char*)&framed->header,
+        sizeof (alarm_frame_t) + framed->header.length);
+    framed->header.length = 0;
+}
+
+static void frame_sink (void *arg, const char *text, size_t len)
+{
+    frame_sink_t *framed = (frame_sink_t*)arg;
+    size_t part;
+
+    if (text == NULL) {
+        frame_flush (framed, ALARM_FRAME_DATA);
+        frame_flush (framed, ALARM_FRAME_OK);
+        framed->acked = 1;
+        return;
+    }
+    while (len > 0) {
+        part = TAG_BUFFER - framed->header.length;
+        if (part > len)
+            part = len;
+        memcpy (framed->buffer + framed->header.length, text, part);
+        framed->header.length += part;
+        text += part;
+        len -= part;
+        if (framed->header.length == TAG_BUFFER)
+            frame_flush (framed, ALARM_FRAME_DATA);
+    }
+}
+
+/*
+ * Parse the optional View_Alarms filters, e.g.
+ *
+ *      View_Alarms Group(2) From(10) To(60)
+ *
+ * Unknown words are ignored.
+ */
+void view_filter_parse (const char *args, view_filter_t *filter)
+{
+    char word[32];
+    int value, used;
+
+    filter->id_group = 0;
+    filter->from = 0;
+    filter->to = -1;
+    while (sscanf (args, " %31[^( \n](%d)%n", word, &value, &used) == 2) {
+        if (strcmp (word, "Group") == 0)
+            filter->id_group = value;
+        else if (strcmp (word, "From") == 0)
+            filter->from = value;
+        else if (strcmp (word, "To") == 0)
+            filter->to = value;
+        args += used;
+    }
+}
+
+int input_validator(const char *keyword_action, const char *keyword_group, int user_arg ) {
+    //if input is valid, return flag that corresponds to the keyword
+    if((strcmp(keyword_action, "Cancel_Alarm") == 0) && (user_arg == 2)) {
+        return 1;
+    }
+    if((strcmp(keyword_action, "View_Alarms") == 0) && (user_arg == 1)) {
+        return 2;
+    }
+    if((strcmp(keyword_action, "Start_Alarm") == 0) && strcmp(keyword_group, "Group") == 0 && (user_arg == 6)) {
+        return 3;
+    }
+    if((strcmp(keyword_action, "Change_Alarm") == 0) && strcmp(keyword_group, "Group") == 0 && (user_arg == 6)) {
+        return 4;
+    }
+    if((strcmp(keyword_action, "Suspend_Alarm") == 0) && (user_arg == 2)) {
+        return 5;
+    }
+    if((strcmp(keyword_action, "Reactivate_Alarm") == 0) && (user_arg == 2)) {
+        return 6;
+    }
+    if((strcmp(keyword_action, "Periodic_Alarm") == 0) && strcmp(keyword_group, "Group") == 0 && (user_arg == 6)) {
+        return 7;
+    }
+
+    // command not found
+    return 0;
+}
+
+/*
+ * Parse the "at" that a new alarm may give in place of its seconds,
+ * followed by the time it is due: a time of day, HH:MM:SS, meaning
+ * the next time the clock shows it, or seconds since the Epoch.
+ * Returns the time since the Epoch, with the length of the line up
+ * to the end of it in "*used", or -1 if there is no such time.
+ */
+static time_t at_parse (const char *line, int *used)
+{
+    struct tm tm;
+    time_t now, at;
+    long epoch;
+    int hour, minute, second, start = -1, end = -1;
+
+    sscanf (line, "%*[^( \n](%*d): %*[^(\n](%*d) at %n", &start);
+    if (start < 0)
+        return -1;
+    if (sscanf (line + start, "%d:%d:%d%n", &hour, &minute, &second, &end) == 3) {
+        if (hour < 0 || hour > 23 || minute < 0 || minute > 59
+            || second < 0 || second > 60)
+            return -1;
+        now = alarm_clock (1);
+        localtime_r (&now, &tm);
+        tm.tm_hour = hour;
+        tm.tm_min = minute;
+        tm.tm_sec = second;
+        tm.tm_isdst = -1;
+        at = mktime (&tm);
+        if (at <= now) {
+            tm.tm_mday++;
+            tm.tm_hour = hour;
+            tm.tm_min = minute;
+            tm.tm_sec = second;
+            tm.tm_isdst = -1;
+            at = mktime (&tm);
+        }
+    } else if (sscanf (line + start, "%ld%n", &epoch, &end) == 1 && epoch > 0)
+        at = epoch;
+    else
+        return -1;
+    *used = start + end;
+    return at;
+}
+
+/*
+ * Parse one command line into "args". Returns the input_validator
+ * code of the command, or 0 if the line is not a valid command.
+ */
+int alarm_parse (const char *line, alarm_args_t *args)
+{
+    int used, value;
+    char option[16];
+    char keyword_action[128];
+    char keyword_group[128];
+    time_t at;
+
+    args->id_alarm = args->id_group = args->seconds = 0;
+    args->at = 0;
+    args->message[0] = '\0';
+
+    /*
+     * Parse input line into seconds (%d) and a message
+     * (%128[^\n]), consisting of up to 128 characters
+     * separated from the seconds by whitespace.
+     */
+    int user_arg = (sscanf (line, "%127[^( \n](%d): %127[^(\n](%d)%d %128[^\n]", keyword_action, &args->id_alarm, keyword_group,
+        &args->id_group, &args->seconds, args->message));
+
+    if (user_arg < 1)
+        return args->action = 0;
+    /*
+     * A new alarm may be due at a given time instead, on the wall
+     * clock (see at_parse); a periodic one then repeats every
+     * "seconds" from there:
+     *
+     *      Start_Alarm(4): Group(1) at 14:30:00 meeting
+     *      Periodic_Alarm(5): Group(1) at 1792169421 3600 hourly
+     *
+     * A one-shot alarm's seconds are then those left until it is due.
+     */
+    if (user_arg == 4 && (strcmp (keyword_action, "Start_Alarm") == 0
+            || strcmp (keyword_action, "Periodic_Alarm") == 0)
+        && (at = at_parse (line, &used)) > 0) {
+        args->at = at;
+        if (keyword_action[0] == 'P')
+            user_arg = 4 + sscanf (line + used, "%d %128[^\n]",
+                &args->seconds, args->message);
+        else {
+            args->seconds = at > alarm_clock (1) ? at - alarm_clock (1) : 0;
+            user_arg = 5 + sscanf (line + used, " %128[^\n]", args->message);
+        }
+    }
+    args->action = input_validator(keyword_action, keyword_group, user_arg);
+    /*
+     * A periodic alarm repeats every "seconds" seconds, forever
+     * or as often as an optional Count(n) ahead of the message
+     * says:
+     *
+     *      Periodic_Alarm(7): Group(1) 10 Count(6) heartbeat
+     *
+     * An alarm may also say how many seconds late it can afford to
+     * fire, so that the alarm thread can serve it in the same
+     * wakeup as other alarms due around then (see alarm_coalesce),
+     * and give a priority class other than 0, the lowest; alarms of
+     * a higher class that are due go first:
+     *
+     *      Start_Alarm(3): Group(1) 60 Slack(5) Priority(2) report
+     */
+    args->count = args->action == 7 ? ALARM_FOREVER : 1;
+    args->slack = args->priority = 0;
+    while ((args->action == 3 || args->action == 7)
+        && sscanf (args->message, "%15[A-Za-z](%d) %n", option, &value, &used) == 2) {
+        if (args->action == 7 && strcmp (option, "Count") == 0)
+            args->count = value;
+        else if (strcmp (option, "Slack") == 0)
+            args->slack = value;
+        else if (strcmp (option, "Priority") == 0)
+            args->priority = value;
+        else
+            break;
+        memmove (args->message, args->message + used,
+            strlen (args->message + used) + 1);
+    }
+    if (args->action == 2)
+        view_filter_parse (line + strlen (keyword_action), &args->filter);
+    return alarm_args_check (args);
+}
+
+/*
+ * Check the arguments of a parsed or decoded command. Returns the
+ * command's input_validator code, or 0 if they are not valid.
+ */
+int alarm_args_check (const alarm_args_t *args)
+{
+    int action = args->action;
+
+    if (action < 1 || action > 7)
+        return 0;
+    if (alarm_readonly && action != 2)
+        return 0;               /* only View_Alarms can read a store */
+    if (action != 2 && (args->id_alarm < 1 || ((action == 3 || action == 4 || action == 7) && args->id_group < 1)))
+        return 0;
+    if (action == 7 && (args->seconds < 1 || args->count == 0 || args->count < ALARM_FOREVER))
+        return 0;
+    if (action == 4 && args->seconds < 1)
+        return 0;               /* it may be periodic */
+    if (args->at < 0 || (args->at != 0 && action != 3 && action != 7))
+        return 0;
+    if (args->slack < 0 || args->priority < 0 || args->priority >= ALARM_CLASSES)
+        return 0;
+    return action;
+}
+
+/*
+ * Carry out a checked command on behalf of "owner" (the channel
+ * that expiry notifications for a new alarm go to). Returns the
+ * command's input_validator code, or -1 if admission control
+ * refused a new alarm (see alarm_admit), its id is already pending,
+ * the store has no room for its message, an alarm to change was
+ * not found, or the command is one that is not implemented yet
+ * (cancel, suspend, reactivate), having replied why.
+ */
+int alarm_execute (const alarm_args_t *args, uint32_t owner,
+    alarm_sink_t sink, void *arg)
+{
+    int status;
+    alarm_shard_t *shard;
+    alarm_t *alarm;
+    alarm_ref_t ref;
+    msg_ref_t message;
+    time_t due;
+    char reply[MSG_MAX + 128], reason[96];
+    int len;
+
+    switch (args->action) {
+        case 1:
+        case 5:
+        case 6:
+            if (args->action == 1)
+                status = alarm_cancel (args->id_alarm, reason, sizeof (reason));
+            else if (args->action == 5)
+                status = alarm_suspend (args->id_alarm, reason, sizeof (reason));
+            else
+                status = alarm_reactivate (args->id_alarm, reason, sizeof (reason));
+            if (status < 0) {
+                len = snprintf (reply, sizeof (reply), "Alarm(%d) Not %s: %s\n",
+                    args->id_alarm, args->action == 1 ? "Cancelled"
+                    : args->action == 5 ? "Suspended" : "Reactivated", reason);
+                sink (arg, reply, len);
+                return -1;
+            }
+            break;
+        case 2: alarm_view (&args->filter, sink, arg); break;
+        case 3:
+        case 7:
+            shard = ALARM_SHARD(args->id_group);
+            //CRITICAL BEGIN
+            status = pthread_mutex_lock (&shard->mutex); if (status != 0){err_abort (status, "Lock mutex");}
+
+            if (alarm_admit (shard, args->id_group, reason, sizeof (reason)) < 0)
+                goto rejected;
+            message = msg_intern (shard->msg, args->message);
+            if (message == 0) {
+                alarm_release (shard, args->id_group);
+                snprintf (reason, sizeof (reason), "alarm store full");
+                goto rejected;
+            }
+            ref = alarm_alloc (shard);
+            if (alarm_id_insert (args->id_alarm, ALARM_HANDLE(ref), reason,
+                    sizeof (reason)) < 0) {
+                alarm_free (shard, ref);
+                msg_release (shard->msg, message);
+                alarm_release (shard, args->id_group);
+                goto rejected;
+            }
+            alarm = ALARM(ref);
+            alarm->id_alarm = args->id_alarm;
+            alarm->id_group = args->id_group;
+            alarm->seconds = args->seconds;
+            alarm->count = args->count;
+            alarm->message = message;
+            ALARM_COLD(ref)->owner = owner;
+            ALARM_COLD(ref)->slack = args->slack;
+            ALARM_COLD(ref)->priority = args->priority;
+            ALARM_COLD(ref)->wall = args->at != 0;
+            alarm->time = args->at != 0
+                ? args->at : alarm_clock (0) + alarm->seconds;
+
+            alarm_insert (shard, ref);
+            len = snprintf (reply, sizeof (reply), "Alarm(%d) Inserted by Main Thread %lu"
+                   " Into Alarm List at %ld: Group(%d) %d %s\n", args->id_alarm, (unsigned long)pthread_self (), alarm_epoch (ref), args->id_group, args->seconds, args->message);
+            /*
+             * Reply while the alarm thread is still locked out, so
+             * that an alarm already due cannot send its expiry
+             * message ahead of the reply.
+             */
+            sink (arg, reply, len);
+            sink (arg, NULL, 0);
+            //CRITICAL END
+            status = pthread_mutex_unlock (&shard->mutex); if (status != 0){err_abort (status, "Unlock mutex");}
+            break;
+        case 4:
+            due = alarm_change (args->id_alarm, args->id_group, args->seconds,
+                args->message, reason, sizeof (reason));
+            if (due < 0) {
+                len = snprintf (reply, sizeof (reply), "Alarm(%d) Not Changed: %s\n",
+                    args->id_alarm, reason);
+                sink (arg, reply, len);
+                return -1;
+            }
+            len = snprintf (reply, sizeof (reply), "Alarm(%d) Changed at %ld:"
+                " Group(%d) %d %s\n", args->id_alarm, (long)due,
+                args->id_group, args->seconds, args->message);
+            sink (arg, reply, len);
+            break;
+    }
+    return args->action;
+
+    /*
+     * A new alarm was refused, with the shard still locked.
+     */
+rejected:
+    status = pthread_mutex_unlock (&shard->mutex); if (status != 0){err_abort (status, "Unlock mutex");}
+    len = snprintf (reply, sizeof (reply), "Alarm(%d) Rejected: %s\n",
+        args->id_alarm, reason);
+    sink (arg, reply, len);
+    return -1;
+}
+
+/*
+ * Parse and carry out one command line. Returns the input_validator
+ * code of the command, -1 if it was refused (as for alarm_execute),
+ * or 0 if the line is not a valid command; nothing is written in
+ * that case, so the caller can report the error its own way.
+ */
+int alarm_command (const char *line, uint32_t owner,
+    alarm_sink_t sink, void *arg)
+{
+    alarm_args_t args;
+
+    if (alarm_parse (line, &args) == 0)
+        return 0;
+    return alarm_execute (&args, owner, sink, arg);
+}
+
+/*
+ * Decode a binary request into "args". Returns the command's
+ * input_validator code, or 0 if the frame is not a valid command,
+ * as it is not if its payload is longer than ALARM_FRAME_PAYLOAD_MAX.
+ */
+int alarm_frame_decode (const alarm_frame_t *frame, const char *payload,
+    alarm_args_t *args)
+{
+    char filter[ALARM_FRAME_PAYLOAD_MAX + 1];
+    size_t len = frame->length;
+
+    if (len > ALARM_FRAME_PAYLOAD_MAX)
+        return 0;
+    args->action = frame->opcode;
+    args->id_alarm = frame->id_alarm;
+    args->id_group = frame->id_group;
+    args->seconds = frame->seconds;
+    args->count = frame->opcode == 7 ? frame->count : 1;
+    args->slack = frame->slack;
+    args->priority = frame->priority;
+    args->at = frame->at;
+    if (frame->opcode == 3 && frame->at != 0)
+        args->seconds = frame->at > alarm_clock (1) ? frame->at - alarm_clock (1) : 0;
+    if (len > MSG_MAX)
+        len = MSG_MAX;
+    memcpy (args->message, payload, len);
+    args->message[len] = '\0';
+    if (frame->opcode == 2) {
+        memcpy (filter, payload, frame->length);
+        filter[frame->length] = '\0';
+        view_filter_parse (filter, &args->filter);
+    }
+    return alarm_args_check (args);
+}
+
+/*
+ * Carry out one binary request, answering it with reply frames.
+ * Returns the input_validator code of the command, or -1 if it was
+ * not valid or was refused (and has been answered with
+ * ALARM_FRAME_ERR).
+ */
+int alarm_frame_request (const alarm_frame_t *frame, const char *payload,
+    uint32_t owner, alarm_sink_t sink, void *arg)
+{
+    frame_sink_t framed;
+    alarm_args_t args;
+    int action;
+
+    framed.sink = sink;
+    framed.arg = arg;
+    framed.acked = 0;
+    memset (&framed.header, 0, sizeof (alarm_frame_t));
+    framed.header.magic = ALARM_FRAME_MAGIC;
+    framed.header.tag = frame->tag;
+    action = alarm_frame_decode (frame, payload, &args);
+    if (action != 0)
+        action = alarm_execute (&args, owner, frame_sink, &framed);
+    if (!framed.acked) {
+        frame_flush (&framed, ALARM_FRAME_DATA);
+        frame_flush (&framed, action <= 0 ? ALARM_FRAME_ERR : ALARM_FRAME_OK);
+    }
+    return action <= 0 ? -1 : action;
+}
+
+/*
+ * Carry out one line of input, which may be a tagged request (see
+ * above). Returns the input_validator code of the command. For an
+ * invalid untagged line, 0 is returned and nothing written, as for
+ * alarm_command; an invalid or refused tagged line has already been
+ * answered with an ERR acknowledgement, and -1 is returned.
+ */
+int alarm_request (const char *line, uint32_t owner,
+    alarm_sink_t sink, void *arg)
+{
+    tag_sink_t tagged;
+    int action, used;
+
+    if (line[0] != '#')
+        return alarm_command (line, owner, sink, arg);
+    tagged.sink = sink;
+    tagged.arg = arg;
+    tagged.line_start = 1;
+    tagged.acked = 0;
+    tagged.len = 0;
+    used = 0;
+    if (sscanf (line, "#%24[^ \n]%n", tagged.tag + 1, &used) != 1
+        || (line[used] != ' ' && line[used] != '\n' && line[used] != '\0')) {
+        sink (arg, "# ERR Bad tag\n", 14);
+        return -1;
+    }
+    tagged.tag[0] = '#';
+    tagged.tag_len = used;
+    tagged.tag[tagged.tag_len++] = ' ';
+    while (line[used] == ' ')
+        used++;
+    action = alarm_command (line + used, owner, tag_sink, &tagged);
+    if (tagged.acked)
+        return action;
+    if (!tagged.line_start)
+        tag_sink (&tagged, "\n", 1);
+    if (action == 0)
+        tag_sink (&tagged, "ERR Bad command\n", 16);
+    else if (action < 0)
+        tag_sink (&tagged, "ERR Rejected\n", 13);
+    else
+        tag_sink (&tagged, "OK\n", 3);
+    tag_flush (&tagged);
+    return action <= 0 ? -1 : action;
+}
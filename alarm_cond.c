@@ -9,249 +9,212 @@
  * enters an earlier timeout, it signals the condition variable
  * so that the alarm thread will wake up and process the earlier
  * timeout first, requeueing the later request.
+ *
+ * The scheduler itself lives in alarm.c and the command language
+ * in alarm_command.c; this file reads the commands typed at the
+ * "Alarm>" prompt, or, when started as
+ *
+ *      alarm_cond -s socket-path
+ *
+ * serves them to many clients over a Unix domain socket instead
+ * (see alarm_server.c). The options
+ *
+ *      -t threads      intake threads serving the socket
+ *      -n shards       scheduler shards, each with an alarm thread
+ *
+ * spread that work over several cores; the number of shards
+ * defaults to the number of intake threads. When the number of
+ * alarms is known up front,
+ *
+ *      -c alarms       preallocate room for this many alarms
+ *      -H              on huge pages
+ *      -L              locked into memory
+ *
+ * lays all alarm storage out in one arena that is faulted in at
+ * startup (see alarm_init). That arena can also be a shared memory
+ * object, which other processes can attach to:
+ *
+ *      -m name         create the store as shared memory "name"
+ *      -a name         attach to it and insert alarms into it
+ *      -r name         attach to it read-only, to view alarms
+ *
+ * The alarms are still fired by the process that created the store.
+ *
+ *      -w usec         spin, rather than sleep, for the last usec
+ *                      microseconds before a deadline
+ *
+ * and, to keep the alarm threads clear of the intake threads,
+ *
+ *      -P cpus         pin the alarm threads to these CPUs ("0,2-3"),
+ *                      one each, in turn
+ *      -F priority     run the alarm threads under SCHED_FIFO
+ *      -I cpus         pin the intake threads to these CPUs
+ *
+ * On a NUMA machine,
+ *
+ *      -N              spread the shards over the NUMA nodes
+ *
+ * keeps each shard's alarms, messages and alarm thread on one node
+ * (unless -P places the threads elsewhere). New alarms are refused
+ * (see alarm_admit.c) beyond
+ *
+ *      -l alarms       pending alarms in all
+ *      -G alarms       pending alarms in one group
+ *      -R rate         new alarms per second in one group,
+ *      -B burst        at most "burst" at once (default: "rate")
+ *
+ * For testing a schedule without waiting for it,
+ *
+ *      -V start        runs on a virtual clock, starting at "start"
+ *                      seconds since the Epoch (0 for now)
+ *
+ * which stands still while commands are read. At the end of the
+ * input it runs forward, through every deadline in turn, for a day,
+ * and the program exits; the alarms fire in the same order, and at
+ * the same (virtual) times, on every run.
  */
-#include <pthread.h>
-#include <time.h>
-#include "errors.h"
-#include <semaphore.h>
+#include <sched.h>
+#include "alarm.h"
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * Replies to commands typed at the prompt go to stdout.
  */
-typedef struct alarm_tag {
-    struct alarm_tag    *link;
-    int                 seconds;
-    int                 id_alarm;
-    int                 id_group;
-    char                message[128];
-    time_t              time;   /* seconds from EPOCH */
-
-
-} alarm_t;
-
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-time_t current_alarm = 0;
-sem_t sem_start_alarm;
-sem_t sem_display_threads;
+static void console_sink (void *arg, const char *text, size_t len)
+{
+    if (text != NULL)
+        fwrite (text, 1, len, stdout);
+}
 
-/*
- * Insert alarm entry on list, in order.
- */
-void alarm_insert (alarm_t *alarm)
+int main (int argc, char *argv[])
 {
-    pthread_t thread_id_main = pthread_self();
     int status;
-    alarm_t **last, *next;
-
-    /*
-     * LOCKING PROTOCOL:
-     *
-     * This routine requires that the caller have locked the
-     * alarm_mutex!
-     */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL) {
-        if (next->time >= alarm->time) {
-            alarm->link = next;
-            *last = alarm;
-            break;
+    int opt, i;
+    int threads = 1, shards = 0, flags = 0;
+    uint32_t capacity = 0;
+    char line[MSG_MAX + 128];
+    const char *server_path = NULL;
+    const char *store = NULL;
+    int attach = 0, readonly = 0, virtual = 0;
+    time_t virtual_start = 0;
+    pthread_t thread_alarm_group_display_removal;
+    pthread_t thread_clock_watch;
+
+    while ((opt = getopt (argc, argv, "s:t:n:c:HLNm:a:r:w:P:F:I:l:G:R:B:V:")) != -1) {
+        switch (opt) {
+            case 's': server_path = optarg; break;
+            case 't': threads = atoi (optarg); break;
+            case 'n': shards = atoi (optarg); break;
+            case 'c': capacity = strtoul (optarg, NULL, 10); break;
+            case 'H': flags |= ALARM_ARENA_HUGE; break;
+            case 'L': flags |= ALARM_ARENA_LOCK; break;
+            case 'N': flags |= ALARM_ARENA_NUMA; break;
+            case 'm': store = optarg; break;
+            case 'a': store = optarg; attach = 1; break;
+            case 'r': store = optarg; attach = readonly = 1; break;
+            case 'w': alarm_spin_ns = atol (optarg) * 1000; break;
+            case 'P':
+                if (thread_place_parse (&alarm_place, optarg) < 0)
+                    goto usage;
+                break;
+            case 'F': alarm_place.priority = atoi (optarg); break;
+            case 'I':
+                if (thread_place_parse (&intake_place, optarg) < 0)
+                    goto usage;
+                break;
+            case 'l': alarm_limits.total = strtoul (optarg, NULL, 10); break;
+            case 'G': alarm_limits.group = strtoul (optarg, NULL, 10); break;
+            case 'R': alarm_limits.rate = strtoul (optarg, NULL, 10); break;
+            case 'B': alarm_limits.burst = strtoul (optarg, NULL, 10); break;
+            case 'V': virtual = 1; virtual_start = atol (optarg); break;
+            default:
+            usage:
+                fprintf (stderr, "usage: %s [-s socket-path [-t threads] [-I cpus]] [-n shards]"
+                    " [-c alarms [-H] [-L] [-m name]] [-N] [-a name | -r name] [-w usec]"
+                    " [-P cpus] [-F priority] [-l alarms] [-G alarms] [-R rate [-B burst]]"
+                    " [-V start]\n",
+                    argv[0]);
+                exit (1);
         }
-        last = &next->link;
-        next = next->link;
     }
-    /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
-     */
-    if (next == NULL) {
-        *last = alarm;
-        alarm->link = NULL;
+    if (alarm_place.priority != 0
+        && (alarm_place.priority < sched_get_priority_min (SCHED_FIFO)
+            || alarm_place.priority > sched_get_priority_max (SCHED_FIFO))) {
+        fprintf (stderr, "SCHED_FIFO priority must be %d to %d\n",
+            sched_get_priority_min (SCHED_FIFO), sched_get_priority_max (SCHED_FIFO));
+        exit (1);
     }
-    printf("Alarm(%d) Inserted by Main Thread %lu"
-           " Into Alarm List at %ld: Group(%d) %d %s\n", alarm->id_alarm, thread_id_main, alarm->time, alarm->id_group, alarm->seconds, alarm->message);
-#ifdef DEBUG
-    printf ("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
-        printf ("%d(%d)[\"%s\"] ", next->time,
-            next->time - time (NULL), next->message);
-    printf ("]\n");
-#endif
-    /*
-     * Wake the alarm thread if it is not busy (that is, if
-     * current_alarm is 0, signifying that it's waiting for
-     * work), or if the new alarm comes before the one on
-     * which the alarm thread is waiting.
-     */
-    if (current_alarm == 0 || alarm->time < current_alarm) {
-        current_alarm = alarm->time;
-        status = pthread_cond_signal (&alarm_cond);
-        if (status != 0) err_abort (status, "Signal cond");
+    if (!ALARM_SPIN && alarm_spin_ns > 0)
+        fprintf (stderr, "Built without spinning (ALARM_SPIN); -w is ignored\n");
+    if (alarm_limits.rate > 1000000000) {
+        fprintf (stderr, "Rate must be at most 1000000000\n");
+        exit (1);
     }
-}
-
-/*
- * The alarm thread's start routine.
- */
-void *alarm_group_display_creation (void *arg)
-{
-    alarm_t *alarm;
-    struct timespec cond_time;
-    time_t now;
-    int status, expired;
-
-    /*
-     * Loop forever, processing commands. The alarm thread will
-     * be disintegrated when the process exits. Lock the mutex
-     * at the start -- it will be unlocked during condition
-     * waits, so the main thread can insert alarms.
-     */
-    status = pthread_mutex_lock (&alarm_mutex); //LOCK MUTEX
-    if (status != 0)
-        err_abort (status, "Lock mutex");
-    while (1) {
+    if (shards == 0)
+        shards = threads;
+    if (shards < 1 || shards > ALARM_SHARDS_MAX) {
+        fprintf (stderr, "Shards must be 1 to %d\n", ALARM_SHARDS_MAX);
+        exit (1);
+    }
+    if (virtual && (attach || server_path != NULL)) {
+        fprintf (stderr, "The virtual clock only runs commands from the prompt\n");
+        exit (1);
+    }
+    if (attach) {
         /*
-         * If the alarm list is empty, wait until an alarm is
-         * added. Setting current_alarm to 0 informs the insert
-         * routine that the thread is not busy.
+         * The alarm threads run in the process that owns the
+         * store; here we only read commands.
          */
-        current_alarm = 0;
-        while (alarm_list == NULL) {
-            status = pthread_cond_wait (&alarm_cond, &alarm_mutex);
-            if (status != 0) err_abort (status, "Wait on cond");
-        }
-        alarm = alarm_list;
-        alarm_list = alarm->link;
-        now = time (NULL);
-        expired = 0;
-        if (alarm->time > now) {
-#ifdef DEBUG
-            printf ("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                alarm->time - time (NULL), alarm->message);
-#endif
-            cond_time.tv_sec = alarm->time;
-            cond_time.tv_nsec = 0;
-            current_alarm = alarm->time;
-            while (current_alarm == alarm->time) {
-                status = pthread_cond_timedwait (
-                    &alarm_cond, &alarm_mutex, &cond_time);
-                if (status == ETIMEDOUT) {
-                    expired = 1;
-                    break;
-                }
-                if (status != 0)
-                    err_abort (status, "Cond timedwait");
-            }
-            if (!expired)
-                alarm_insert (alarm);
-        } else
-            expired = 1;
-        if (expired) {
-            printf ("(%d) %s\n", alarm->seconds, alarm->message);
-            free (alarm);
+        if (server_path != NULL) {
+            fprintf (stderr, "An attached store cannot be served\n");
+            exit (1);
         }
+        if (alarm_limits.total != 0 || alarm_limits.group != 0
+            || alarm_limits.rate != 0 || alarm_limits.burst != 0)
+            fprintf (stderr, "The store's owner sets the limits; -l, -G, -R and -B are ignored\n");
+        if (alarm_attach (store, readonly) < 0)
+            exit (1);
+        shards = 0;
+    } else if (store != NULL) {
+        if (alarm_share (store, shards, capacity, flags) < 0)
+            exit (1);
+    } else
+        alarm_init (shards, capacity, flags);
+    if ((flags & ALARM_ARENA_NUMA) && alarm_place.cpu_count == 0
+        && alarm_numa_place (&alarm_place, shards) < 0)
+        fprintf (stderr, "Cannot read the CPUs of the NUMA nodes\n");
+    if (virtual)
+        alarm_clock_virtual (virtual_start);
+
+    for (i = 0; i < shards; i++) {
+        status = thread_create (&alarm_shards[i].thread, &alarm_place, i, alarm_group_display_creation, &alarm_shards[i]);
+        if (status != 0)
+            err_abort (status, "alarm group display creation");
     }
-}
-
-void alarm_change (alarm_t *alarm){}
-
-void alarm_cancel (alarm_t *alarm){}
-
-void alarm_suspend (alarm_t *alarm){}
-
-void alarm_reactivate (alarm_t *alarm){}
-
-void alarm_view (void){}
-
 
-void *alarm_group_display_removal (void *arg) {
-}
-
-
-int input_validator(const char *keyword_action, const char *keyword_group, int user_arg ) {
-    //if input is valid, return flag that corresponds to the keyword
-    if((strcmp(keyword_action, "Cancel_Alarm") == 0) && (user_arg == 2)) {
-        return 1;
-    }
-    if((strcmp(keyword_action, "View_Alarms") == 0) && (user_arg == 1)) {
-        return 2;
-    }
-    if((strcmp(keyword_action, "Start_Alarm") == 0) && strcmp(keyword_group, "Group") == 0 && (user_arg == 6)) {
-        return 3;
+    if (shards > 0) {
+        status = pthread_create (&thread_clock_watch, NULL, alarm_clock_watch, NULL);
+        if (status != 0)
+            err_abort (status, "clock watch creation");
     }
-    if((strcmp(keyword_action, "Change_Alarm") == 0) && strcmp(keyword_group, "Group") == 0 && (user_arg == 6)) {
-        return 4;
-    }
-    if((strcmp(keyword_action, "Suspend_Alarm") == 0) && (user_arg == 2)) {
-        return 5;
-    }
-    if((strcmp(keyword_action, "Reactivate_Alarm") == 0) && (user_arg == 2)) {
-        return 6;
-    }
-
-    err_abort (69, "command not found");
-}
-
-int main (int argc, char *argv[])
-{
-    int status;
-    int action;
-    char line[128];
-    alarm_t *alarm;
-    pthread_t thread_alarm_group_display_creation;
-    pthread_t thread_alarm_group_display_removal;
-    char keyword_action[128];
-    char keyword_group[128];
-    sem_init(&sem_display_threads, 0, 0);
-
-    status = pthread_create (&thread_alarm_group_display_creation, NULL, alarm_group_display_creation, NULL);
-    if (status != 0)
-        err_abort (status, "alarm group display creation");
 
     status = pthread_create (&thread_alarm_group_display_removal, NULL, alarm_group_display_removal, NULL);
     if (status != 0)
         err_abort (status, "alarm group display removal");
 
+    if (server_path != NULL)
+        return alarm_server (server_path, threads);
 
     while (1) {
         printf ("Alarm> ");
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
+        if (fgets (line, sizeof (line), stdin) == NULL) {
+            if (virtual) {
+                printf ("\n");
+                alarm_clock_run (alarm_now_ns (0) + (int64_t)24 * 3600 * 1000000000);
+            }
+            exit (0);
+        }
         if (strlen (line) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL){errno_abort ("Allocate alarm");}
-
-        /*
-         * Parse input line into seconds (%d) and a message
-         * (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
-         */
-        int user_arg = (sscanf (line, "%[^(\n](%d): %[^(\n](%d)%d %128[^\n]", keyword_action, &alarm->id_alarm, keyword_group,
-            &alarm->id_group, &alarm->seconds, alarm->message));
-
-        if (user_arg == -1 == -1 || alarm->id_alarm < 1 || alarm->id_group < 1) {
+        if (alarm_request (line, 0, console_sink, NULL) == 0)
             fprintf (stderr, "Bad command\n");
-            free (alarm);
-
-        }
-        else {
-            input_validator(keyword_action, keyword_group, user_arg);
-            //CRITICAL BEGIN
-            status = pthread_mutex_lock (&alarm_mutex); if (status != 0){err_abort (status, "Lock mutex");}
-
-            alarm->time = time (NULL) + alarm->seconds;
-
-            alarm_insert (alarm);
-            //CRITICAL END
-            status = pthread_mutex_unlock (&alarm_mutex); if (status != 0){err_abort (status, "Unlock mutex");}
-            alarm_group_display_creation(alarm);
-            sem_wait(&sem_display_threads);
-        }
     }
 }
@@ -0,0 +1,269 @@
+/*
+ * alarm_ids.c
+ *
+ * The alarm id index. Alarm ids are chosen by the users, so the
+ * scheduler keeps a map from each pending alarm's id to its handle
+ * (see alarm_handle_t in alarm.h), which finds the alarm for
+ * Change_Alarm without searching the shards, and lets Start_Alarm
+ * and Periodic_Alarm refuse an id that is already pending at the
+ * cost of one hash probe.
+ *
+ * Since an id is not tied to a group, the index is not part of any
+ * shard. It is split instead into partitions by the hash of the id,
+ * each an open-addressing table with its own mutex, so that shards
+ * inserting different ids rarely meet. A partition mutex is only
+ * ever held for one probe and is taken last: a shard mutex may be
+ * held while taking it, never the other way round.
+ *
+ * A handle found here may be stale by the time its alarm is used,
+ * if the alarm fired and its pool entry was reused in between; the
+ * generation in the handle says so (alarm_handle_valid), and the
+ * caller looks the id up again.
+ *
+ * Deleted ids leave a tombstone (a zero handle), which a later
+ * insert into the same probe sequence reuses. When live entries and
+ * tombstones fill 70% of a partition, it is rebuilt without the
+ * tombstones, into a table twice the size of what is left or, in a
+ * preallocated (or shared) store, into its spare, like the intern
+ * tables of the message arena.
+ */
+#include "alarm.h"
+
+typedef struct id_entry_tag {
+    int32_t             id_alarm;       /* 0 if empty */
+    alarm_handle_t      handle;         /* 0 if deleted */
+} id_entry_t;
+
+typedef struct id_part_tag {
+    pthread_mutex_t     mutex;
+    id_entry_t          *entries;
+    id_entry_t          *spare;         /* NULL if the table can grow */
+    uint32_t            size;           /* a power of 2 */
+    uint32_t            used;           /* entries and tombstones */
+} __attribute__ ((aligned (64))) id_part_t;
+
+static id_part_t *id_parts = NULL;
+static int id_part_count = 0;
+
+#define IDS_ALIGN(size)         (((size) + 63) & ~(size_t)63)
+#define ID_HASH(id)             ((uint32_t)(id) * 2654435769u)
+#define ID_PART(id)             (&id_parts[(ID_HASH(id) >> 16) % id_part_count])
+
+/*
+ * Layout of the index of a preallocated store for "capacity" alarms
+ * in "parts" partitions: the partitions, then two tables for each.
+ * A partition is sized for twice its share of the alarms, so that
+ * uneven hashing does not fill it.
+ */
+static uint32_t ids_table_entries (int parts, uint32_t capacity)
+{
+    uint32_t entries = 64;
+
+    while (entries < ((size_t)capacity / parts + 1) * 2 * 10 / 7 + 1)
+        entries *= 2;
+    return entries;
+}
+
+size_t ids_space (int parts, uint32_t capacity)
+{
+    return IDS_ALIGN(parts * sizeof (id_part_t))
+        + (size_t)parts * 2 * ids_table_entries (parts, capacity)
+            * sizeof (id_entry_t);
+}
+
+/*
+ * Set up an index of "parts" partitions, at "space" for a
+ * preallocated store (see ids_space) or, with a NULL "space", with
+ * tables that grow as needed. With "attach", the store was set up
+ * by another process and only our pointers into it are. The
+ * mutexes of a store in shared memory work across processes.
+ */
+void ids_init (char *space, int parts, uint32_t capacity, int attach,
+    int shared)
+{
+    pthread_mutexattr_t attr;
+    uint32_t entries = 64;
+    id_entry_t *tables = NULL;
+    int i, status;
+
+    id_part_count = parts;
+    if (space == NULL) {
+        id_parts = (id_part_t*)aligned_alloc (64, parts * sizeof (id_part_t));
+        if (id_parts == NULL) errno_abort ("Allocate id index");
+        memset (id_parts, 0, parts * sizeof (id_part_t));
+    } else {
+        entries = ids_table_entries (parts, capacity);
+        id_parts = (id_part_t*)space;
+        tables = (id_entry_t*)(space + IDS_ALIGN(parts * sizeof (id_part_t)));
+        if (attach)
+            return;
+    }
+    pthread_mutexattr_init (&attr);
+    if (shared)
+        pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+    for (i = 0; i < parts; i++) {
+        status = pthread_mutex_init (&id_parts[i].mutex, &attr);
+        if (status != 0) err_abort (status, "Init mutex");
+        id_parts[i].size = entries;
+        if (tables != NULL) {
+            id_parts[i].entries = tables + (size_t)i * 2 * entries;
+            id_parts[i].spare = id_parts[i].entries + entries;
+        } else {
+            id_parts[i].entries = (id_entry_t*)calloc (entries, sizeof (id_entry_t));
+            if (id_parts[i].entries == NULL) errno_abort ("Allocate id index");
+        }
+    }
+    pthread_mutexattr_destroy (&attr);
+}
+
+/*
+ * Rebuild a partition without its tombstones. Returns -1 if a fixed
+ * partition is still too full afterwards.
+ */
+static int ids_rebuild (id_part_t *part)
+{
+    id_entry_t *old = part->entries;
+    uint32_t old_size = part->size;
+    uint32_t i, j, live = 0;
+
+    for (i = 0; i < old_size; i++)
+        if (old[i].handle != 0)
+            live++;
+    if (part->spare != NULL) {
+        if ((live + 1) * 10 > part->size * 7)
+            return -1;
+        part->entries = part->spare;
+        part->spare = old;
+        memset (part->entries, 0, part->size * sizeof (id_entry_t));
+    } else {
+        part->size = 64;
+        while (part->size < (live + 1) * 2)
+            part->size *= 2;
+        part->entries = (id_entry_t*)calloc (part->size, sizeof (id_entry_t));
+        if (part->entries == NULL) errno_abort ("Allocate id index");
+    }
+    part->used = live;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].handle == 0)
+            continue;
+        j = ID_HASH(old[i].id_alarm) & (part->size - 1);
+        while (part->entries[j].id_alarm != 0)
+            j = (j + 1) & (part->size - 1);
+        part->entries[j] = old[i];
+    }
+    if (part->spare == NULL)
+        free (old);
+    return 0;
+}
+
+/*
+ * Find the entry of an id, live or deleted, or else the empty entry
+ * its probe sequence ends at. "*tomb" is set to the first tombstone
+ * on the way, if any.
+ */
+static id_entry_t *ids_probe (id_part_t *part, int id_alarm, id_entry_t **tomb)
+{
+    uint32_t i;
+
+    *tomb = NULL;
+    for (i = ID_HASH(id_alarm) & (part->size - 1);
+         part->entries[i].id_alarm != 0;
+         i = (i + 1) & (part->size - 1)) {
+        if (part->entries[i].id_alarm == id_alarm)
+            return &part->entries[i];
+        if (part->entries[i].handle == 0 && *tomb == NULL)
+            *tomb = &part->entries[i];
+    }
+    return &part->entries[i];
+}
+
+/*
+ * Record that "id_alarm" is pending as "handle". Returns 0, or -1
+ * with the reason in "reason" if the id is already pending or the
+ * index is full.
+ */
+int alarm_id_insert (int id_alarm, alarm_handle_t handle, char *reason,
+    size_t size)
+{
+    id_part_t *part = ID_PART(id_alarm);
+    id_entry_t *entry, *tomb;
+    int status, result = 0;
+
+    status = pthread_mutex_lock (&part->mutex);
+    if (status != 0) err_abort (status, "Lock mutex");
+    if ((part->used + 1) * 10 > part->size * 7 && ids_rebuild (part) < 0) {
+        snprintf (reason, size, "too many alarms");
+        result = -1;
+    } else {
+        entry = ids_probe (part, id_alarm, &tomb);
+        if (entry->id_alarm == id_alarm && entry->handle != 0) {
+            snprintf (reason, size, "id already pending");
+            result = -1;
+        } else if (entry->id_alarm == id_alarm)
+            entry->handle = handle;
+        else {
+            if (tomb != NULL)
+                entry = tomb;
+            else
+                part->used++;
+            entry->id_alarm = id_alarm;
+            entry->handle = handle;
+        }
+    }
+    pthread_mutex_unlock (&part->mutex);
+    return result;
+}
+
+/*
+ * Point a pending id at another handle (its alarm was copied to
+ * another shard).
+ */
+void alarm_id_update (int id_alarm, alarm_handle_t handle)
+{
+    id_part_t *part = ID_PART(id_alarm);
+    id_entry_t *entry, *tomb;
+    int status;
+
+    status = pthread_mutex_lock (&part->mutex);
+    if (status != 0) err_abort (status, "Lock mutex");
+    entry = ids_probe (part, id_alarm, &tomb);
+    if (entry->id_alarm == id_alarm)
+        entry->handle = handle;
+    pthread_mutex_unlock (&part->mutex);
+}
+
+/*
+ * Forget "id_alarm", if it is still pending as "handle".
+ */
+void alarm_id_remove (int id_alarm, alarm_handle_t handle)
+{
+    id_part_t *part = ID_PART(id_alarm);
+    id_entry_t *entry, *tomb;
+    int status;
+
+    status = pthread_mutex_lock (&part->mutex);
+    if (status != 0) err_abort (status, "Lock mutex");
+    entry = ids_probe (part, id_alarm, &tomb);
+    if (entry->id_alarm == id_alarm && entry->handle == handle)
+        entry->handle = 0;
+    pthread_mutex_unlock (&part->mutex);
+}
+
+/*
+ * The handle of the pending alarm "id_alarm", or 0.
+ */
+alarm_handle_t alarm_id_lookup (int id_alarm)
+{
+    id_part_t *part = ID_PART(id_alarm);
+    id_entry_t *entry, *tomb;
+    alarm_handle_t handle = 0;
+    int status;
+
+    status = pthread_mutex_lock (&part->mutex);
+    if (status != 0) err_abort (status, "Lock mutex");
+    entry = ids_probe (part, id_alarm, &tomb);
+    if (entry->id_alarm == id_alarm)
+        handle = entry->handle;
+    pthread_mutex_unlock (&part->mutex);
+    return handle;
+}
@@ -0,0 +1,341 @@
+/*
+ * alarm_msg.c
+ *
+ * The message arena. Alarm messages are stored out of line, in
+ * one large reservation of address space, and referred to by
+ * their byte offset (msg_ref_t). Since the arena never moves, a
+ * reader that got hold of a msg_ref_t through an alarm can use it
+ * without further locking for as long as the alarm itself stays
+ * valid (see the epoch scheme in alarm.c).
+ *
+ * Messages are interned: every distinct text is stored once, with
+ * a reference count, and alarms carrying the same text (typically
+ * the alarms of one group) share it. A hash table of msg_ref_t
+ * finds an existing copy of a text.
+ *
+ * The arena is divided into one heap per scheduler shard, each
+ * with its own slots, free lists and intern table, so that shards
+ * never share any of this state. A text is interned per heap. In
+ * a preallocated (or shared) alarm store, the heaps and their
+ * tables live in the store too (see msg_space).
+ *
+ * Each text occupies a slot of a whole number of MSG_UNIT bytes:
+ * the reference count, one byte recording the slot size, then the
+ * text and its terminating NUL. A slot is freed when its last
+ * reference is released, and goes on a free list per slot size.
+ *
+ * A heap that is out of room (in a preallocated store, or once the
+ * arena's reservation is used up) refuses new texts: msg_intern
+ * returns 0, which is never a message, and the command that wanted
+ * the text is refused.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * msg_intern and msg_release require that the caller have locked
+ * the mutex of the shard that owns the heap!
+ */
+#include <sys/mman.h>
+#include "alarm.h"
+
+#define MSG_UNIT        16
+#define MSG_HEADER      5       /* reference count and slot size */
+#define MSG_CLASSES     ((MSG_MAX + MSG_HEADER + 1 + MSG_UNIT - 1) / MSG_UNIT)
+#define MSG_TOMBSTONE   ((msg_ref_t)-1)
+
+/*
+ * An entry of the intern table. The hash is kept beside the
+ * reference so that a probe only touches the arena on a likely
+ * match.
+ */
+typedef struct msg_entry_tag {
+    uint32_t            hash;
+    msg_ref_t           ref;    /* 0 if empty, MSG_TOMBSTONE if deleted */
+} msg_entry_t;
+
+/*
+ * One shard's part of the arena. In a preallocated arena the intern
+ * table has a fixed size, and a spare table of the same size to
+ * rebuild into when tombstones pile up.
+ */
+struct msg_heap_tag {
+    uint32_t            start;          /* the heap's slice of the arena */
+    uint32_t            top;            /* next never-used byte */
+    uint32_t            end;            /* end of the heap's slice */
+    uint32_t            free_list[MSG_CLASSES + 1];
+    size_t              live;           /* bytes in allocated slots */
+    msg_entry_t         *table;
+    msg_entry_t         *spare;         /* NULL if the table can grow */
+    uint32_t            table_size;     /* a power of 2 */
+    uint32_t            table_used;     /* entries, including tombstones */
+    uint32_t            distinct;       /* live texts */
+};
+
+char *msg_arena = NULL;
+static msg_heap_t *msg_heaps = NULL;
+static int msg_heap_count = 0;
+
+#define MSG_REFCOUNT(slot)      ((uint32_t*)(msg_arena + (slot)))
+#define MSG_ALIGN(size)         (((size) + 63) & ~(size_t)63)
+
+/*
+ * Layout of a preallocated message store for "messages" messages,
+ * however long: the heaps, then two intern tables per heap, then
+ * the arena proper.
+ */
+static uint32_t msg_table_entries (int heaps, uint32_t messages)
+{
+    uint32_t entries = 64;
+
+    while (entries < ((size_t)messages / heaps + 1) * 2 * 10 / 7)
+        entries *= 2;
+    return entries;
+}
+
+static size_t msg_text_size (uint32_t messages)
+{
+    size_t size = ((size_t)messages + 1) * MSG_CLASSES * MSG_UNIT;
+
+    return size > MSG_ARENA_MAX ? MSG_ARENA_MAX : size;
+}
+
+size_t msg_space (int heaps, uint32_t messages)
+{
+    return MSG_ALIGN(heaps * sizeof (msg_heap_t))
+        + MSG_ALIGN((size_t)heaps * 2
+            * msg_table_entries (heaps, messages) * sizeof (msg_entry_t))
+        + msg_text_size (messages);
+}
+
+/*
+ * Set up the arena and divide it into "heaps" heaps.
+ *
+ * With a NULL "space", address space is reserved for MSG_ARENA_MAX
+ * bytes of text and pages are only backed by memory once they are
+ * first written; the intern tables grow as needed.
+ *
+ * Otherwise the whole store is laid out in the msg_space bytes at
+ * "space", sized for "messages" messages. If "attach" is set, the
+ * store was already set up (by another process, in shared memory),
+ * and only our pointers to it are.
+ */
+void msg_init (char *space, int heaps, uint32_t messages, int attach)
+{
+    size_t size = MSG_ARENA_MAX;
+    uint32_t slice, entries = 0;
+    msg_entry_t *tables = NULL;
+    int i;
+
+    if (space == NULL) {
+        msg_arena = (char*)mmap (NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (msg_arena == MAP_FAILED) errno_abort ("Reserve message arena");
+        msg_heaps = (msg_heap_t*)calloc (heaps, sizeof (msg_heap_t));
+        if (msg_heaps == NULL) errno_abort ("Allocate message heaps");
+    } else {
+        entries = msg_table_entries (heaps, messages);
+        msg_heaps = (msg_heap_t*)space;
+        space += MSG_ALIGN(heaps * sizeof (msg_heap_t));
+        tables = (msg_entry_t*)space;
+        space += MSG_ALIGN((size_t)heaps * 2 * entries * sizeof (msg_entry_t));
+        msg_arena = space;
+        size = msg_text_size (messages);
+    }
+    msg_heap_count = heaps;
+    if (attach)
+        return;
+    slice = size / heaps / MSG_UNIT * MSG_UNIT;
+    for (i = 0; i < heaps; i++) {
+        msg_heaps[i].start = msg_heaps[i].top = i * slice;
+        msg_heaps[i].end = (i + 1) * slice;
+        if (tables != NULL) {
+            msg_heaps[i].table = tables + (size_t)i * 2 * entries;
+            msg_heaps[i].spare = msg_heaps[i].table + entries;
+            msg_heaps[i].table_size = entries;
+        }
+    }
+    msg_heaps[0].top = MSG_UNIT;        /* offset 0 is never used */
+}
+
+msg_heap_t *msg_heap (int index)
+{
+    return &msg_heaps[index];
+}
+
+/*
+ * Ask for the memory of a heap, its slice of the arena and, in a
+ * preallocated store, its intern tables, to come from NUMA node
+ * "node" (see alarm_numa_bind). Only pages not yet touched move.
+ */
+void msg_bind (int index, int node)
+{
+    msg_heap_t *heap = &msg_heaps[index];
+
+    alarm_numa_bind (msg_arena + heap->start, heap->end - heap->start, node);
+    if (heap->spare != NULL)
+        alarm_numa_bind (heap->table < heap->spare ? heap->table : heap->spare,
+            2 * (size_t)heap->table_size * sizeof (msg_entry_t), node);
+}
+
+/*
+ * FNV-1a.
+ */
+static uint32_t msg_hash (const char *text, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    while (len-- > 0)
+        hash = (hash ^ (unsigned char)*text++) * 16777619u;
+    return hash;
+}
+
+/*
+ * Rebuild the intern table at twice the number of live texts,
+ * dropping tombstones on the way. A fixed-size table is rebuilt
+ * into its spare instead; returns -1 if it would still be too full.
+ */
+static int msg_table_resize (msg_heap_t *heap)
+{
+    msg_entry_t *old = heap->table;
+    uint32_t old_size = heap->table_size;
+    uint32_t i, j;
+
+    if (heap->spare != NULL) {
+        if ((heap->distinct + 1) * 10 > heap->table_size * 7)
+            return -1;
+        heap->table = heap->spare;
+        heap->spare = old;
+        memset (heap->table, 0, heap->table_size * sizeof (msg_entry_t));
+    } else {
+        heap->table_size = 64;
+        while (heap->table_size < (heap->distinct + 1) * 2)
+            heap->table_size *= 2;
+        heap->table = (msg_entry_t*)calloc (heap->table_size, sizeof (msg_entry_t));
+        if (heap->table == NULL) errno_abort ("Allocate intern table");
+    }
+    heap->table_used = heap->distinct;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].ref == 0 || old[i].ref == MSG_TOMBSTONE)
+            continue;
+        j = old[i].hash & (heap->table_size - 1);
+        while (heap->table[j].ref != 0)
+            j = (j + 1) & (heap->table_size - 1);
+        heap->table[j] = old[i];
+    }
+    if (heap->spare == NULL)
+        free (old);
+    return 0;
+}
+
+/*
+ * Allocate a slot of "units" units, or return 0 if the heap is full.
+ */
+static uint32_t msg_slot_alloc (msg_heap_t *heap, uint32_t units)
+{
+    uint32_t slot = heap->free_list[units];
+
+    if (slot != 0)
+        memcpy (&heap->free_list[units], msg_arena + slot + 8, sizeof (slot));
+    else {
+        if (heap->top > heap->end - units * MSG_UNIT)
+            return 0;
+        slot = heap->top;
+        heap->top += units * MSG_UNIT;
+    }
+    heap->live += units * MSG_UNIT;
+    return slot;
+}
+
+/*
+ * Return a reference to a copy of the message (truncated to
+ * MSG_MAX bytes), sharing an existing copy if there is one, or 0 if
+ * it is a new text and the heap has no room for it.
+ */
+msg_ref_t msg_intern (msg_heap_t *heap, const char *text)
+{
+    size_t len = strnlen (text, MSG_MAX);
+    uint32_t hash = msg_hash (text, len);
+    uint32_t units, slot, i, free_entry = UINT32_MAX;
+    msg_ref_t ref;
+    int full = 0;
+
+    /*
+     * A table that cannot be rebuilt is still below 70% used, so
+     * an existing copy can be found in it.
+     */
+    if ((heap->table_used + 1) * 10 > heap->table_size * 7)
+        full = msg_table_resize (heap) < 0;
+    for (i = hash & (heap->table_size - 1); ;
+         i = (i + 1) & (heap->table_size - 1)) {
+        ref = heap->table[i].ref;
+        if (ref == 0)
+            break;
+        if (ref == MSG_TOMBSTONE) {
+            if (free_entry == UINT32_MAX)
+                free_entry = i;
+            continue;
+        }
+        if (heap->table[i].hash == hash
+            && memcmp (MSG_TEXT(ref), text, len) == 0
+            && MSG_TEXT(ref)[len] == '\0') {
+            (*MSG_REFCOUNT(ref - MSG_HEADER))++;
+            return ref;
+        }
+    }
+    if (full)
+        return 0;
+    units = (len + MSG_HEADER + 1 + MSG_UNIT - 1) / MSG_UNIT;
+    slot = msg_slot_alloc (heap, units);
+    if (slot == 0)
+        return 0;
+    if (free_entry == UINT32_MAX) {
+        free_entry = i;
+        heap->table_used++;
+    }
+    *MSG_REFCOUNT(slot) = 1;
+    msg_arena[slot + 4] = (char)units;
+    memcpy (msg_arena + slot + MSG_HEADER, text, len);
+    msg_arena[slot + MSG_HEADER + len] = '\0';
+    ref = slot + MSG_HEADER;
+    heap->table[free_entry].hash = hash;
+    heap->table[free_entry].ref = ref;
+    heap->distinct++;
+    return ref;
+}
+
+/*
+ * Drop one reference; the text is freed with the last one.
+ */
+void msg_release (msg_heap_t *heap, msg_ref_t ref)
+{
+    uint32_t slot = ref - MSG_HEADER;
+    uint32_t units, i;
+
+    if (--*MSG_REFCOUNT(slot) != 0)
+        return;
+    i = msg_hash (MSG_TEXT(ref), strlen (MSG_TEXT(ref)))
+        & (heap->table_size - 1);
+    while (heap->table[i].ref != ref)
+        i = (i + 1) & (heap->table_size - 1);
+    heap->table[i].ref = MSG_TOMBSTONE;
+    heap->distinct--;
+
+    units = (unsigned char)msg_arena[slot + 4];
+    memcpy (msg_arena + slot + 8, &heap->free_list[units], sizeof (slot));
+    heap->free_list[units] = slot;
+    heap->live -= units * MSG_UNIT;
+}
+
+/*
+ * Bytes of arena currently holding live messages, and the size
+ * of the intern table.
+ */
+size_t msg_arena_used (void)
+{
+    size_t used = 0;
+    int i;
+
+    for (i = 0; i < msg_heap_count; i++)
+        used += msg_heaps[i].live
+            + msg_heaps[i].table_size * sizeof (msg_entry_t);
+    return used;
+}
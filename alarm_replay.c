@@ -0,0 +1,202 @@
+/*
+ * alarm_replay.c
+ *
+ * Replays a captured command stream against the scheduler, through
+ * the same parsing and input_validator path as the "Alarm>" prompt
+ * (alarm_request), and reports how fast it went:
+ *
+ *      alarm_replay [-n shards] [-c alarms] [-x speed | -f | -v] log
+ *
+ * Each line of the log is a command as typed at the prompt, tagged
+ * or not, preceded by the time it arrived, in seconds (since the
+ * Epoch, or since anything else; only the differences count):
+ *
+ *      1792169421.250 Start_Alarm(1): Group(2) 30 Hello
+ *      1792169421.300 #8 Change_Alarm(1): Group(2) 45 Hello again
+ *
+ * Lines that do not start with a time, and blank lines, are skipped.
+ *
+ *      -x speed        replay at "speed" times the pace of the log
+ *                      (the default is 1, the pace it was captured at)
+ *      -f              replay as fast as the scheduler takes it
+ *      -v              replay on the virtual clock (see
+ *                      alarm_clock_virtual), starting at the time of
+ *                      the first line: between commands the clock
+ *                      runs forward through every deadline, so
+ *                      alarms fire where they did in production, and
+ *                      after the last command it runs on for a day
+ *
+ * With -x and -f, alarms still pending after the last command are
+ * not waited for. The report gives the commands per second reached,
+ * how many were invalid or refused (by admission control, see
+ * alarm_admit, or for want of the alarm to change), a histogram of
+ * the time each command took, how far behind the log a paced replay
+ * fell at worst, and the alarms fired with their firing latency.
+ */
+#include "alarm.h"
+
+#define REPLAY_BUCKETS  ALARM_LATENCY_BUCKETS
+
+static uint64_t replay_fired;
+
+/*
+ * Replies to the replayed commands and expiry messages are dropped,
+ * but expiries are counted.
+ */
+static void replay_sink (void *arg, const char *text, size_t len)
+{
+}
+
+static void replay_notify (uint32_t owner, const char *text, size_t len)
+{
+    __atomic_add_fetch (&replay_fired, 1, __ATOMIC_RELAXED);
+}
+
+static int64_t replay_now_ns (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Count "ns" in a histogram with the buckets of alarm_latency.
+ */
+static void replay_record (uint64_t histogram[REPLAY_BUCKETS], int64_t ns)
+{
+    int bucket = 0;
+
+    ns /= 1000;
+    while (ns > 0 && bucket < REPLAY_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    histogram[bucket]++;
+}
+
+static void replay_print (const char *title, uint64_t histogram[REPLAY_BUCKETS])
+{
+    int i;
+
+    printf ("%s:\n", title);
+    for (i = 0; i < REPLAY_BUCKETS; i++) {
+        if (histogram[i] == 0)
+            continue;
+        if (i == 0)
+            printf ("  %10s %8s us %8lu\n", "", "< 1", (unsigned long)histogram[i]);
+        else
+            printf ("  %8ld - %8ld us %8lu\n", 1L << (i - 1), 1L << i,
+                (unsigned long)histogram[i]);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    FILE *log;
+    char line[MSG_MAX + 256];
+    double speed = 1.0, stamp, first = 0;
+    int fast = 0, virtual = 0, shards = 1, opt, used, i, status, result;
+    uint32_t capacity = 0;
+    uint64_t commands = 0, invalid = 0, refused = 0, skipped = 0;
+    uint64_t took[REPLAY_BUCKETS] = {0}, fired[ALARM_LATENCY_BUCKETS];
+    uint64_t wakeups, count;
+    int64_t start, base = 0, target, now, lag, lag_max = 0, elapsed;
+    struct timespec until;
+
+    while ((opt = getopt (argc, argv, "n:c:x:fv")) != -1) {
+        switch (opt) {
+            case 'n': shards = atoi (optarg); break;
+            case 'c': capacity = strtoul (optarg, NULL, 10); break;
+            case 'x': speed = atof (optarg); break;
+            case 'f': fast = 1; break;
+            case 'v': virtual = 1; break;
+            default:
+            usage:
+                fprintf (stderr, "usage: %s [-n shards] [-c alarms]"
+                    " [-x speed | -f | -v] log\n", argv[0]);
+                exit (1);
+        }
+    }
+    if (optind != argc - 1 || speed <= 0 || fast + virtual > 1)
+        goto usage;
+    if (shards < 1 || shards > ALARM_SHARDS_MAX) {
+        fprintf (stderr, "Shards must be 1 to %d\n", ALARM_SHARDS_MAX);
+        exit (1);
+    }
+    log = fopen (argv[optind], "r");
+    if (log == NULL) errno_abort ("Open log");
+
+    alarm_init (shards, capacity, 0);
+    alarm_notify = replay_notify;
+    start = replay_now_ns ();
+    while (fgets (line, sizeof (line), log) != NULL) {
+        if (sscanf (line, "%lf %n", &stamp, &used) != 1 || line[used] == '\0') {
+            skipped++;
+            continue;
+        }
+        if (commands == 0) {
+            first = stamp;
+            /*
+             * The alarm threads start once the clock they run on is
+             * known.
+             */
+            if (virtual) {
+                alarm_clock_virtual ((time_t)stamp);
+                base = alarm_now_ns (0);
+            }
+            for (i = 0; i < shards; i++) {
+                status = thread_create (&alarm_shards[i].thread, &alarm_place,
+                    i, alarm_group_display_creation, &alarm_shards[i]);
+                if (status != 0) err_abort (status, "Create alarm thread");
+            }
+            start = replay_now_ns ();
+        }
+        /*
+         * Wait for the moment the command arrived in the log, on
+         * the virtual clock or (scaled) on the real one.
+         */
+        if (virtual)
+            alarm_clock_run (base + (int64_t)((stamp - first) * 1e9));
+        else if (!fast) {
+            target = start + (int64_t)((stamp - first) / speed * 1e9);
+            until.tv_sec = target / 1000000000;
+            until.tv_nsec = target % 1000000000;
+            while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+                ;
+            lag = replay_now_ns () - target;
+            if (lag > lag_max)
+                lag_max = lag;
+        }
+        now = replay_now_ns ();
+        result = alarm_request (line + used, 1, replay_sink, NULL);
+        replay_record (took, replay_now_ns () - now);
+        commands++;
+        if (result == 0)
+            invalid++;
+        else if (result < 0)
+            refused++;
+    }
+    fclose (log);
+    elapsed = replay_now_ns () - start;
+    if (virtual && commands > 0)
+        alarm_clock_run (alarm_now_ns (0) + (int64_t)24 * 3600 * 1000000000);
+
+    printf ("%lu commands (%lu invalid, %lu refused, %lu lines skipped)"
+        " in %.3f s: %.0f commands/s\n",
+        (unsigned long)commands, (unsigned long)invalid,
+        (unsigned long)refused, (unsigned long)skipped, elapsed / 1e9,
+        elapsed > 0 ? commands / (elapsed / 1e9) : 0.0);
+    if (!fast && !virtual)
+        printf ("fell behind the log by at most %.3f ms\n", lag_max / 1e6);
+    replay_print ("command time", took);
+    alarm_wakeups (&wakeups, &count);
+    printf ("%lu alarms fired in %lu wakeups, %lu pending\n",
+        (unsigned long)__atomic_load_n (&replay_fired, __ATOMIC_RELAXED),
+        (unsigned long)wakeups, (unsigned long)alarm_admitted ());
+    if (!virtual) {
+        alarm_latency (-1, fired);
+        replay_print ("firing latency", fired);
+    }
+    return 0;
+}
@@ -0,0 +1,600 @@
+/*
+ * alarm_server.c
+ *
+ * A Unix domain socket front end, so that many clients can submit
+ * alarms to one scheduler at the same time. Clients speak the same
+ * line-oriented command language as the "Alarm>" prompt (see
+ * alarm_command.c); replies, and the expiry messages of the alarms
+ * a client created, are written back on its own connection.
+ *
+ * Each of a number of intake threads runs an epoll loop over the
+ * listening socket, its own client connections (all non-blocking)
+ * and its own eventfd. The listener is registered with
+ * EPOLLEXCLUSIVE in every intake's epoll set, so that a new
+ * connection wakes only one of them, and the connection stays with
+ * the intake that accepted it. Commands are parsed and executed
+ * right in that loop, each going straight to the shard of its
+ * group, so intake threads share no lock with each other.
+ *
+ * The alarm threads cannot write to sockets themselves, since they
+ * must never block while they hold a shard mutex: they append
+ * expiry messages to the client's output buffer and kick the
+ * owning intake's eventfd, and the intake thread does the writing.
+ *
+ * Commands may also arrive as binary frames (alarm_frame_t), mixed
+ * freely with text lines on the same connection.
+ *
+ * Clients may pipeline tagged requests (see alarm_command.c) as
+ * deeply as they like. Commands are only read while the client's
+ * unsent output is below SERVER_OUT_HIGH; past that the connection
+ * stops being read, and so the client is held back by its own
+ * socket buffer, until the output drains below SERVER_OUT_LOW. A
+ * single long reply is written out as it is produced (see
+ * client_sink).
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The client table is divided between the intakes by slot number
+ * (see CLIENT_INTAKE). An intake's slots, the output buffers of its
+ * clients and its dirty list are protected by the intake's mutex.
+ * The alarm threads take an intake mutex while holding their shard
+ * mutex, so an intake thread must never lock a shard mutex while
+ * it holds its own.
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <stddef.h>
+#include <signal.h>
+#include "alarm.h"
+
+#define SERVER_CLIENTS  65535           /* connections at once */
+#define SERVER_IN_MAX   4096            /* longest command line */
+#define SERVER_OUT_HIGH (256 << 10)     /* stop reading commands ... */
+#define SERVER_OUT_LOW  (64 << 10)      /* ... until output drains to this */
+#define SERVER_OUT_MAX  (4 << 20)       /* unread output before we drop */
+#define SERVER_EVENTS   256
+#define SERVER_INTAKES  64              /* intake threads at most */
+#define SERVER_LISTEN   0               /* epoll tags; clients are 1.. */
+#define SERVER_WAKE     (SERVER_CLIENTS + 1)
+
+/*
+ * A client connection. Its owner value, handed to the scheduler
+ * with every alarm it creates, combines the slot number with a
+ * generation count so that a late expiry message is not delivered
+ * to a different client that reuses the slot.
+ */
+struct intake_tag;
+
+typedef struct client_tag {
+    struct intake_tag   *intake;        /* the thread serving it */
+    int                 fd;
+    uint32_t            owner;
+    size_t              in_len;
+    char                in[SERVER_IN_MAX];
+    char                *out;           /* pending output */
+    size_t              out_len;
+    size_t              out_size;
+    size_t              reply_end;      /* end of the last reply in out */
+    uint32_t            events;         /* epoll events armed */
+    int                 paused;         /* not reading: output backlog */
+    int                 dirty;          /* on the intake's dirty list */
+    int                 overflow;       /* output limit exceeded */
+    struct client_tag   *next_dirty;
+} client_t;
+
+/*
+ * An intake thread and the clients it serves.
+ */
+typedef struct intake_tag {
+    pthread_mutex_t     mutex;
+    client_t            *dirty;         /* clients with new output */
+    int                 epoll;
+    int                 wake;           /* eventfd */
+    int                 listener;
+    int                 next_slot;
+    int                 index;
+    pthread_t           thread;
+} __attribute__ ((aligned (64))) intake_t;
+
+static client_t *server_clients[SERVER_CLIENTS + 1];
+static uint16_t server_generation[SERVER_CLIENTS + 1];
+static intake_t *server_intakes = NULL;
+static int server_intake_count = 0;
+
+/*
+ * Slot s belongs to intake (s - 1) % server_intake_count.
+ */
+#define CLIENT_INTAKE(slot) \
+    (&server_intakes[((slot) - 1) % server_intake_count])
+
+/*
+ * Append to a client's output buffer. Only output the client has
+ * left unread counts against SERVER_OUT_MAX: a reply to one of its
+ * commands ("reply" nonzero) is finished however long it is, and
+ * the buffer up to its end (reply_end) is left out of the limit, so
+ * that a large View_Alarms still reaches a client that reads it.
+ * Commands are not run while the buffer is above SERVER_OUT_HIGH
+ * (see client_backlog), so replies cannot pile up.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the client's
+ * intake mutex!
+ */
+static void client_append (client_t *client, const char *text, size_t len,
+    int reply)
+{
+    size_t size;
+
+    if (client->overflow)
+        return;
+    if (!reply && client->out_len - client->reply_end + len > SERVER_OUT_MAX) {
+        client->overflow = 1;
+        return;
+    }
+    if (client->out_len + len > client->out_size) {
+        size = client->out_size ? client->out_size : 1024;
+        while (size < client->out_len + len)
+            size *= 2;
+        client->out = (char*)realloc (client->out, size);
+        if (client->out == NULL) errno_abort ("Allocate client output");
+        client->out_size = size;
+    }
+    memcpy (client->out + client->out_len, text, len);
+    client->out_len += len;
+    if (reply)
+        client->reply_end = client->out_len;
+}
+
+/*
+ * The alarm_notify hook: queue an expiry message for the client
+ * that owns the alarm, if it is still connected, and wake its
+ * intake thread to send it.
+ */
+static void server_notify (uint32_t owner, const char *text, size_t len)
+{
+    intake_t *intake = CLIENT_INTAKE(owner & 0xffff);
+    client_t *client;
+    uint64_t one = 1;
+    int status, wake = 0;
+
+    status = pthread_mutex_lock (&intake->mutex);
+    if (status != 0) err_abort (status, "Lock mutex");
+    client = server_clients[owner & 0xffff];
+    if (client != NULL && client->owner == owner) {
+        client_append (client, text, len, 0);
+        if (!client->dirty) {
+            client->dirty = 1;
+            client->next_dirty = intake->dirty;
+            wake = intake->dirty == NULL;
+            intake->dirty = client;
+        }
+    }
+    status = pthread_mutex_unlock (&intake->mutex);
+    if (status != 0) err_abort (status, "Unlock mutex");
+    if (wake && write (intake->wake, &one, sizeof (one)) < 0
+        && errno != EAGAIN)
+        errno_abort ("Wake server");
+}
+
+/*
+ * Write as much pending output as the socket takes, and arm the
+ * epoll events to match: EPOLLOUT while output is pending, EPOLLIN
+ * unless the client is paused. A paused client is only resumed by
+ * the caller (see client_resume); until then EPOLLOUT stays armed
+ * so that it is noticed once the output has drained. Returns -1 if
+ * the client should be dropped.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the client's
+ * intake mutex!
+ */
+static int client_flush (client_t *client, int slot)
+{
+    struct epoll_event event;
+    ssize_t written;
+    size_t done = 0;
+
+    if (client->overflow)
+        return -1;
+    while (done < client->out_len) {
+        written = write (client->fd, client->out + done,
+            client->out_len - done);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += written;
+    }
+    memmove (client->out, client->out + done, client->out_len - done);
+    client->out_len -= done;
+    client->reply_end = done < client->reply_end ? client->reply_end - done : 0;
+    event.events = client->paused ? EPOLLOUT
+        : EPOLLIN | (client->out_len > 0 ? EPOLLOUT : 0);
+    if (event.events != client->events) {
+        client->events = event.events;
+        event.data.u64 = slot;
+        if (epoll_ctl (client->intake->epoll, EPOLL_CTL_MOD, client->fd,
+                &event) < 0)
+            errno_abort ("Modify client events");
+    }
+    return 0;
+}
+
+/*
+ * The alarm_sink_t for replies to a client's own commands. A long
+ * reply, such as a View_Alarms of a large process, is written out
+ * between its chunks, as far as the socket takes it, rather than
+ * gathered whole first.
+ */
+static void client_sink (void *arg, const char *text, size_t len)
+{
+    client_t *client = (client_t*)arg;
+    int status;
+
+    if (text == NULL)
+        return;
+    status = pthread_mutex_lock (&client->intake->mutex);
+    if (status != 0) err_abort (status, "Lock mutex");
+    client_append (client, text, len, 1);
+    if (client->out_len > SERVER_OUT_HIGH
+        && client_flush (client, client->owner & 0xffff) < 0)
+        client->overflow = 1;           /* gone: dropped on return */
+    status = pthread_mutex_unlock (&client->intake->mutex);
+    if (status != 0) err_abort (status, "Unlock mutex");
+}
+
+/*
+ * Check whether a client's output backlog calls for pausing or
+ * resuming the reading of its commands. Returns 1 if the client
+ * is (still) paused.
+ */
+static int client_backlog (client_t *client)
+{
+    int status;
+
+    status = pthread_mutex_lock (&client->intake->mutex);
+    if (status != 0) err_abort (status, "Lock mutex");
+    if (client->out_len > SERVER_OUT_HIGH)
+        client->paused = 1;
+    else if (client->out_len <= SERVER_OUT_LOW)
+        client->paused = 0;
+    status = pthread_mutex_unlock (&client->intake->mutex);
+    if (status != 0) err_abort (status, "Unlock mutex");
+    return client->paused;
+}
+
+/*
+ * Drop a client.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * This routine requires that the caller have locked the client's
+ * intake mutex!
+ */
+static void client_close (int slot)
+{
+    client_t *client, **last;
+
+    client = server_clients[slot];
+    server_clients[slot] = NULL;
+    if (client->dirty) {
+        for (last = &client->intake->dirty; *last != client;
+             last = &(*last)->next_dirty)
+            ;
+        *last = client->next_dirty;
+    }
+    close (client->fd);
+    free (client->out);
+    free (client);
+}
+
+/*
+ * Accept the waiting connections, placing them in the intake's own
+ * slots. Only the intake itself ever fills or empties its slots,
+ * so it may look at them without its mutex.
+ */
+static void server_accept (intake_t *intake)
+{
+    struct epoll_event event;
+    client_t *client;
+    int fd, slot, status;
+
+    while (1) {
+        fd = accept4 (intake->listener, NULL, NULL,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                fprintf (stderr, "Server: out of descriptors\n");
+                return;
+            }
+            errno_abort ("Accept client");
+        }
+        for (slot = intake->next_slot; server_clients[slot] != NULL; ) {
+            slot += server_intake_count;
+            if (slot > SERVER_CLIENTS)
+                slot = intake->index + 1;
+            if (slot == intake->next_slot)
+                break;
+        }
+        if (server_clients[slot] != NULL) {
+            close (fd);         /* table full */
+            continue;
+        }
+        intake->next_slot = slot + server_intake_count;
+        if (intake->next_slot > SERVER_CLIENTS)
+            intake->next_slot = intake->index + 1;
+        client = (client_t*)calloc (1, sizeof (client_t));
+        if (client == NULL) errno_abort ("Allocate client");
+        client->intake = intake;
+        client->fd = fd;
+        server_generation[slot]++;
+        client->owner = ((uint32_t)server_generation[slot] << 16) | slot;
+        status = pthread_mutex_lock (&intake->mutex);
+        if (status != 0) err_abort (status, "Lock mutex");
+        server_clients[slot] = client;
+        status = pthread_mutex_unlock (&intake->mutex);
+        if (status != 0) err_abort (status, "Unlock mutex");
+        client->events = event.events = EPOLLIN;
+        event.data.u64 = slot;
+        if (epoll_ctl (intake->epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+            errno_abort ("Add client");
+    }
+}
+
+/*
+ * Run the complete lines and frames waiting in the client's input
+ * buffer, stopping early if the client gets paused. Returns 1 if
+ * paused.
+ */
+static int client_lines (client_t *client)
+{
+    char *line, *end, *limit;
+    alarm_frame_t frame;
+    size_t used;
+    int paused = 0;
+
+    line = client->in;
+    limit = client->in + client->in_len;
+    while (line < limit) {
+        if ((unsigned char)*line == ALARM_FRAME_MAGIC) {
+            if (limit - line < (ptrdiff_t)sizeof (alarm_frame_t))
+                break;
+            memcpy (&frame, line, sizeof (alarm_frame_t));
+            if (frame.length > ALARM_FRAME_PAYLOAD_MAX) {
+                frame.length = 0;
+                frame.opcode = 0;
+                alarm_frame_request (&frame, line, client->owner, client_sink, client);
+                line = limit;   /* cannot find the next frame: drop it all */
+                break;
+            }
+            if (limit - line < (ptrdiff_t)(sizeof (alarm_frame_t) + frame.length))
+                break;
+            if ((paused = client_backlog (client)))
+                break;
+            alarm_frame_request (&frame, line + sizeof (alarm_frame_t),
+                client->owner, client_sink, client);
+            line += sizeof (alarm_frame_t) + frame.length;
+            continue;
+        }
+        if ((end = memchr (line, '\n', limit - line)) == NULL)
+            break;
+        if ((paused = client_backlog (client)))
+            break;
+        *end = '\0';
+        if (end > line
+            && alarm_request (line, client->owner, client_sink, client) == 0)
+            client_sink (client, "Bad command\n", 12);
+        line = end + 1;
+    }
+    used = line - client->in;
+    memmove (client->in, line, client->in_len - used);
+    client->in_len -= used;
+    if (!paused && client->in_len == SERVER_IN_MAX) {
+        client_sink (client, "Bad command\n", 12);
+        client->in_len = 0;     /* line too long: drop it */
+    }
+    return paused;
+}
+
+/*
+ * Run the commands already buffered, then read and run whatever
+ * else the client has sent, until the socket is drained or the
+ * client is paused. Returns -1 once the client has gone away.
+ */
+static int client_read (client_t *client)
+{
+    ssize_t got;
+
+    while (1) {
+        if (client_lines (client))
+            return 0;
+        got = read (client->fd, client->in + client->in_len,
+            SERVER_IN_MAX - client->in_len);
+        if (got == 0)
+            return -1;
+        if (got < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        client->in_len += got;
+    }
+}
+
+/*
+ * An intake thread's start routine: serve its clients until the
+ * process is killed.
+ */
+static void *intake_run (void *arg)
+{
+    intake_t *intake = (intake_t*)arg;
+    struct epoll_event events[SERVER_EVENTS];
+    client_t *client;
+    uint64_t count;
+    int ready, i, slot, status, drop;
+
+    while (1) {
+        ready = epoll_wait (intake->epoll, events, SERVER_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Wait for events");
+        }
+        for (i = 0; i < ready; i++) {
+            slot = (int)events[i].data.u64;
+            if (slot == SERVER_LISTEN) {
+                server_accept (intake);
+                continue;
+            }
+            if (slot == SERVER_WAKE) {
+                /*
+                 * Send the expiry messages queued by the alarm
+                 * threads.
+                 */
+                if (read (intake->wake, &count, sizeof (count)) < 0
+                    && errno != EAGAIN)
+                    errno_abort ("Read eventfd");
+                status = pthread_mutex_lock (&intake->mutex);
+                if (status != 0) err_abort (status, "Lock mutex");
+                while ((client = intake->dirty) != NULL) {
+                    intake->dirty = client->next_dirty;
+                    client->dirty = 0;
+                    slot = client->owner & 0xffff;
+                    if (client_flush (client, slot) < 0)
+                        client_close (slot);
+                }
+                status = pthread_mutex_unlock (&intake->mutex);
+                if (status != 0) err_abort (status, "Unlock mutex");
+                continue;
+            }
+            client = server_clients[slot];
+            if (client == NULL)
+                continue;
+            /*
+             * Read commands unless paused, and send the replies. A
+             * paused client whose output has drained far enough is
+             * resumed, and its buffered commands are run.
+             */
+            drop = 0;
+            if (!client->paused
+                && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                drop = client_read (client);
+            while (drop == 0) {
+                status = pthread_mutex_lock (&intake->mutex);
+                if (status != 0) err_abort (status, "Lock mutex");
+                drop = client_flush (client, slot);
+                status = pthread_mutex_unlock (&intake->mutex);
+                if (status != 0) err_abort (status, "Unlock mutex");
+                if (drop < 0 || !client->paused || client_backlog (client))
+                    break;
+                drop = client_read (client);
+            }
+            if (drop < 0) {
+                status = pthread_mutex_lock (&intake->mutex);
+                if (status != 0) err_abort (status, "Lock mutex");
+                client_close (slot);
+                status = pthread_mutex_unlock (&intake->mutex);
+                if (status != 0) err_abort (status, "Unlock mutex");
+            }
+        }
+    }
+}
+
+/*
+ * Serve commands on a Unix domain socket at "path", with "threads"
+ * intake threads (the calling thread being one of them), until the
+ * process is killed. Never returns unless the socket cannot be set
+ * up.
+ */
+int alarm_server (const char *path, int threads)
+{
+    struct sockaddr_un address;
+    struct epoll_event event;
+    struct rlimit limit;
+    intake_t *intake;
+    int listener, i, status;
+
+    /*
+     * Every client costs a descriptor; allow as many as we may.
+     */
+    if (getrlimit (RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit (RLIMIT_NOFILE, &limit);
+    }
+    /*
+     * A client that goes away with output pending must cost us an
+     * EPIPE, not the process.
+     */
+    signal (SIGPIPE, SIG_IGN);
+    if (strlen (path) >= sizeof (address.sun_path)) {
+        fprintf (stderr, "Socket path too long\n");
+        return 1;
+    }
+    if (threads < 1 || threads > SERVER_INTAKES) {
+        fprintf (stderr, "Intake threads must be 1 to %d\n", SERVER_INTAKES);
+        return 1;
+    }
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy (address.sun_path, path);
+    listener = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0) errno_abort ("Create socket");
+    unlink (path);
+    if (bind (listener, (struct sockaddr*)&address, sizeof (address)) < 0
+        || listen (listener, SOMAXCONN) < 0) {
+        perror (path);
+        return 1;
+    }
+
+    server_intakes = (intake_t*)aligned_alloc (64, threads * sizeof (intake_t));
+    if (server_intakes == NULL) errno_abort ("Allocate intakes");
+    memset (server_intakes, 0, threads * sizeof (intake_t));
+    server_intake_count = threads;
+    for (i = 0; i < threads; i++) {
+        intake = &server_intakes[i];
+        status = pthread_mutex_init (&intake->mutex, NULL);
+        if (status != 0) err_abort (status, "Init mutex");
+        intake->index = i;
+        intake->next_slot = i + 1;
+        intake->listener = listener;
+        intake->epoll = epoll_create1 (EPOLL_CLOEXEC);
+        if (intake->epoll < 0) errno_abort ("Create epoll");
+        intake->wake = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (intake->wake < 0) errno_abort ("Create eventfd");
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.u64 = SERVER_LISTEN;
+        if (epoll_ctl (intake->epoll, EPOLL_CTL_ADD, listener, &event) < 0)
+            errno_abort ("Add listener");
+        event.events = EPOLLIN;
+        event.data.u64 = SERVER_WAKE;
+        if (epoll_ctl (intake->epoll, EPOLL_CTL_ADD, intake->wake, &event) < 0)
+            errno_abort ("Add eventfd");
+    }
+    alarm_notify = server_notify;
+    printf ("Serving alarms on %s\n", path);
+    fflush (stdout);
+
+    for (i = 1; i < threads; i++) {
+        status = thread_create (&server_intakes[i].thread, &intake_place,
+            i, intake_run, &server_intakes[i]);
+        if (status != 0) err_abort (status, "Create intake thread");
+    }
+    thread_place_self (&intake_place, 0);
+    intake_run (&server_intakes[0]);
+    return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * alarm_stress.c
+ *
+ * Stress and correctness test for the concurrent scheduler. Many
+ * threads drive the command language at once, as intake threads
+ * would, while the alarm threads fire and View_Alarms readers walk
+ * the lists without locks:
+ *
+ *      alarm_stress [-t threads] [-n shards] [-s seconds] [-c alarms]
+ *
+ * Each worker thread owns a range of alarm ids and, for "seconds"
+ * seconds, picks at random among Start_Alarm and Periodic_Alarm
+ * (due within a couple of seconds, in any group, so that shards are
+ * shared and Change_Alarm moves alarms between them), Change_Alarm
+ * and View_Alarms. Cancel_Alarm, Suspend_Alarm and Reactivate_Alarm
+ * are not implemented yet, and are only checked to be refused.
+ * Every alarm's message says which id it is, what group it is in
+ * and when it is due, and the expiry hook checks, as alarms fire:
+ *
+ *      no alarm fires before it is due
+ *      no alarm fires more often than it was started for (duplicates)
+ *      each shard fires its alarms in order of their deadlines
+ *
+ * and, once every alarm has fired, that each fired exactly as often
+ * as it was started for (nothing was lost). Views are checked to be
+ * sorted by time. The run fails with a nonzero exit status, after
+ * listing what went wrong.
+ *
+ * The test is meant to be built with -fsanitize=thread as well as
+ * with -fsanitize=address,undefined (see README), so that races and
+ * memory errors show up even when the invariants hold.
+ *
+ * A deadline in a message is worked out by the worker just before
+ * the command, so it may be a second earlier than the one the
+ * scheduler worked out; the order check allows for that. Periodic
+ * alarms carry a deadline of 0, since it changes as they fire, and
+ * are only checked for lost and duplicate firings.
+ */
+#include <stdarg.h>
+#include "alarm.h"
+
+#define STRESS_IDS      4096            /* alarm ids per worker */
+#define STRESS_ERRORS   20              /* failures listed in full */
+
+typedef struct stress_worker_tag {
+    pthread_t           thread;
+    int                 index;
+    unsigned int        seed;
+    uint64_t            commands;
+    char                periodic[STRESS_IDS]; /* last started as periodic */
+} stress_worker_t;
+
+static int stress_workers, stress_groups = 64;
+static volatile int stress_stop;
+static uint32_t *stress_expected;       /* firings started for, per id */
+static uint32_t *stress_fired;          /* firings seen, per id */
+static time_t stress_last[ALARM_SHARDS_MAX]; /* last deadline fired */
+static uint64_t stress_errors, stress_views;
+
+static void stress_fail (const char *format, ...)
+    __attribute__ ((format (printf, 1, 2)));
+
+static void stress_fail (const char *format, ...)
+{
+    va_list args;
+
+    if (__atomic_add_fetch (&stress_errors, 1, __ATOMIC_RELAXED) > STRESS_ERRORS)
+        return;
+    va_start (args, format);
+    vfprintf (stderr, format, args);
+    va_end (args);
+}
+
+/*
+ * The expiry hook. It is called by the alarm thread of the alarm's
+ * shard with the shard's mutex held, so stress_last of that shard
+ * is only ever touched by one thread at a time.
+ */
+static void stress_notify (uint32_t owner, const char *text, size_t len)
+{
+    int id_alarm, id_group;
+    long due;
+    time_t now = alarm_clock (0);
+    alarm_shard_t *shard;
+    uint32_t fired;
+
+    if (sscanf (text, "(%*d) %d %d %ld", &id_alarm, &id_group, &due) != 3
+        || id_alarm < 1 || id_alarm > stress_workers * STRESS_IDS) {
+        stress_fail ("Unknown expiry: %.*s", (int)len, text);
+        return;
+    }
+    fired = __atomic_add_fetch (&stress_fired[id_alarm], 1, __ATOMIC_RELAXED);
+    if (fired > __atomic_load_n (&stress_expected[id_alarm], __ATOMIC_ACQUIRE))
+        stress_fail ("Alarm(%d) fired %u times, started for %u\n", id_alarm,
+            fired, __atomic_load_n (&stress_expected[id_alarm], __ATOMIC_RELAXED));
+    if (due == 0)
+        return;                 /* periodic */
+    if (now < due)
+        stress_fail ("Alarm(%d) fired at %ld, due at %ld\n",
+            id_alarm, (long)now, due);
+    shard = ALARM_SHARD(id_group);
+    if (due < stress_last[shard - alarm_shards] - 1)
+        stress_fail ("Alarm(%d) due at %ld fired after one due at %ld\n",
+            id_alarm, due, (long)stress_last[shard - alarm_shards]);
+    if (due > stress_last[shard - alarm_shards])
+        stress_last[shard - alarm_shards] = due;
+}
+
+/*
+ * Check that a view lists its alarms in order of time.
+ */
+static void stress_view_sink (void *arg, const char *text, size_t len)
+{
+    time_t *last = (time_t*)arg;
+    const char *line = text, *end = text + len;
+    long time;
+
+    while (line < end) {
+        if (sscanf (line, "%*d. Alarm(%*d): Group(%*d) %ld", &time) == 1) {
+            if (time < *last)
+                stress_fail ("View out of order: %ld after %ld\n", time, (long)*last);
+            *last = time;
+        }
+        line = memchr (line, '\n', end - line);
+        if (line == NULL)
+            break;
+        line++;
+    }
+}
+
+static void stress_reply_sink (void *arg, const char *text, size_t len)
+{
+}
+
+static void *stress_worker (void *arg)
+{
+    stress_worker_t *worker = (stress_worker_t*)arg;
+    char line[MSG_MAX + 128];
+    int id_alarm, id_group, seconds, count, op, result, slot;
+    time_t last;
+
+    while (!__atomic_load_n (&stress_stop, __ATOMIC_RELAXED)) {
+        slot = rand_r (&worker->seed) % STRESS_IDS;
+        id_alarm = worker->index * STRESS_IDS + 1 + slot;
+        id_group = 1 + rand_r (&worker->seed) % stress_groups;
+        seconds = rand_r (&worker->seed) % 3;
+        op = rand_r (&worker->seed) % 16;
+        worker->commands++;
+        if (op < 8) {
+            /*
+             * Count the firings before the alarm can fire, and take
+             * them back if it is refused.
+             */
+            count = op < 6 ? 1 : 1 + rand_r (&worker->seed) % 3;
+            __atomic_add_fetch (&stress_expected[id_alarm], count, __ATOMIC_RELEASE);
+            if (count == 1)
+                snprintf (line, sizeof (line), "Start_Alarm(%d): Group(%d) %d %d %d %ld\n",
+                    id_alarm, id_group, seconds, id_alarm, id_group,
+                    (long)(alarm_clock (0) + seconds));
+            else
+                snprintf (line, sizeof (line),
+                    "Periodic_Alarm(%d): Group(%d) 1 Count(%d) %d %d 0\n",
+                    id_alarm, id_group, count, id_alarm, id_group);
+            result = alarm_command (line, 1, stress_reply_sink, NULL);
+            if (result <= 0)
+                __atomic_sub_fetch (&stress_expected[id_alarm], count, __ATOMIC_RELEASE);
+            else
+                worker->periodic[slot] = count > 1;
+            continue;
+        }
+        switch (op) {
+            case 8: case 9: case 10:
+                snprintf (line, sizeof (line), "Change_Alarm(%d): Group(%d) %d %d %d %ld\n",
+                    id_alarm, id_group, seconds + 1, id_alarm, id_group,
+                    worker->periodic[slot] ? 0L : (long)(alarm_clock (0) + seconds + 1));
+                break;
+            case 11:
+                snprintf (line, sizeof (line), "Cancel_Alarm(%d)\n", id_alarm);
+                break;
+            case 12:
+                snprintf (line, sizeof (line), "Suspend_Alarm(%d)\n", id_alarm);
+                break;
+            case 13:
+                snprintf (line, sizeof (line), "Reactivate_Alarm(%d)\n", id_alarm);
+                break;
+            default:
+                if (op == 14)
+                    snprintf (line, sizeof (line), "View_Alarms\n");
+                else
+                    snprintf (line, sizeof (line), "View_Alarms Group(%d)\n", id_group);
+                last = 0;
+                alarm_command (line, 1, stress_view_sink, &last);
+                __atomic_add_fetch (&stress_views, 1, __ATOMIC_RELAXED);
+                continue;
+        }
+        result = alarm_command (line, 1, stress_reply_sink, NULL);
+        if (op >= 11 && result >= 0)
+            stress_fail ("Not refused: %s", line);
+    }
+    return NULL;
+}
+
+int main (int argc, char *argv[])
+{
+    stress_worker_t *workers;
+    int threads = 8, shards = 4, seconds = 5, opt, i, status, waited;
+    uint32_t capacity = 0;
+    uint64_t commands = 0, expected = 0, fired = 0, wakeups, count;
+
+    while ((opt = getopt (argc, argv, "t:n:s:c:")) != -1) {
+        switch (opt) {
+            case 't': threads = atoi (optarg); break;
+            case 'n': shards = atoi (optarg); break;
+            case 's': seconds = atoi (optarg); break;
+            case 'c': capacity = strtoul (optarg, NULL, 10); break;
+            default:
+                fprintf (stderr, "usage: %s [-t threads] [-n shards]"
+                    " [-s seconds] [-c alarms]\n", argv[0]);
+                exit (1);
+        }
+    }
+    if (threads < 1 || shards < 1 || shards > ALARM_SHARDS_MAX || seconds < 1) {
+        fprintf (stderr, "Bad threads, shards or seconds\n");
+        exit (1);
+    }
+    stress_workers = threads;
+    stress_expected = calloc (threads * STRESS_IDS + 1, sizeof (uint32_t));
+    stress_fired = calloc (threads * STRESS_IDS + 1, sizeof (uint32_t));
+    workers = calloc (threads, sizeof (stress_worker_t));
+    if (stress_expected == NULL || stress_fired == NULL || workers == NULL)
+        errno_abort ("Allocate counters");
+
+    alarm_init (shards, capacity, 0);
+    alarm_notify = stress_notify;
+    for (i = 0; i < shards; i++) {
+        status = pthread_create (&alarm_shards[i].thread, NULL,
+            alarm_group_display_creation, &alarm_shards[i]);
+        if (status != 0) err_abort (status, "Create alarm thread");
+    }
+    for (i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].seed = i + 1;
+        status = pthread_create (&workers[i].thread, NULL, stress_worker, &workers[i]);
+        if (status != 0) err_abort (status, "Create worker");
+    }
+    sleep (seconds);
+    __atomic_store_n (&stress_stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < threads; i++) {
+        status = pthread_join (workers[i].thread, NULL);
+        if (status != 0) err_abort (status, "Join worker");
+        commands += workers[i].commands;
+    }
+    free (workers);
+
+    /*
+     * Every alarm is due within a few seconds of the last command;
+     * wait for them all to fire.
+     */
+    for (waited = 0; waited < 100 && alarm_admitted () > 0; waited++)
+        usleep (100000);
+    if (alarm_admitted () > 0)
+        stress_fail ("%u alarms still pending\n", alarm_admitted ());
+    for (i = 1; i <= threads * STRESS_IDS; i++) {
+        expected += stress_expected[i];
+        fired += __atomic_load_n (&stress_fired[i], __ATOMIC_RELAXED);
+        if (__atomic_load_n (&stress_fired[i], __ATOMIC_RELAXED) != stress_expected[i])
+            stress_fail ("Alarm(%d) fired %u times, started for %u\n", i,
+                __atomic_load_n (&stress_fired[i], __ATOMIC_RELAXED),
+                stress_expected[i]);
+    }
+    alarm_wakeups (&wakeups, &count);
+    printf ("%lu commands from %d threads on %d shards in %d s, %lu views\n",
+        (unsigned long)commands, threads, shards, seconds,
+        (unsigned long)stress_views);
+    printf ("%lu firings expected, %lu fired, %lu wakeups: %s (%lu errors)\n",
+        (unsigned long)expected, (unsigned long)fired, (unsigned long)wakeups,
+        stress_errors == 0 ? "PASS" : "FAIL", (unsigned long)stress_errors);
+    return stress_errors == 0 ? 0 : 1;
+}